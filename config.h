@@ -143,6 +143,12 @@
  */
 #define SPARSE_HEAP_START (void *)0x2130051300000000UL
 
+/*
+ * Size of the emulated address range for mem_map regions, which starts
+ * just past the largest possible heap (and stays below 2^63)
+ */
+#define MAX_SPARSE_MAP (15UL << 57)
+
 /*
  * Number of bytes in each page
  */
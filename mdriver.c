@@ -98,10 +98,16 @@ typedef struct
     {
         ALLOC,
         FREE,
-        REALLOC
+        REALLOC,
+        BATCH_ALLOC,
+        BATCH_FREE,
+        ALIGNED_ALLOC
     } type;      /* type of request */
-    int index;   /* index for free() to use later */
+    int index;   /* index for free() to use later; for a batch request,
+                    the position of its first id in batch_ids */
+    int count;   /* number of ids in a batch request */
     size_t size; /* byte size of alloc/realloc request */
+    size_t align; /* alignment of an aligned alloc request */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -116,6 +122,9 @@ typedef struct
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
+    int *batch_ids;       /* ids of the blocks of all batch requests */
+    int num_batch_ids;
+    char **batch_ptrs;    /* pointers passed with a batch request */
 } trace_t;
 
 /*
@@ -144,6 +153,12 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    mm_stats_t counters; /* hot-path counters of the utilization run */
+    mm_growth_t growth;  /* heap growth during the utilization run */
+    int trims;           /* requests after which the heap was smaller */
+    double int_frag;     /* internal fragmentation at the high water mark */
+    double peak_frag;    /* peak of the sampled external fragmentation */
+    int peak_frag_op;    /* request after which it was sampled, or 0 */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -188,6 +203,21 @@ int verbose = REF_ONLY ? 0 : 1; /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+/* If set, replay runs of mallocs and frees with the batch functions */
+static bool batch_mode = false;
+/* If set, print the free space this many times during each trace */
+static int frag_samples = 0;
+/* The free space sampled during the last utilization run, for -F */
+typedef struct
+{
+    int op;            /* request after which the sample was taken */
+    size_t heap_size;  /* heap size then, not counting mapped regions */
+    mm_heapinfo_t info;
+} free_sample_t;
+static free_sample_t *free_samples = NULL;
+static int num_free_samples = 0;
+/* Threads for the heap checks of -D; 0 means one per CPU */
+static int check_threads = 0;
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -245,6 +275,8 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static void add_batch_id(trace_t *trace, int index);
+static void batch_trace(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -255,11 +287,23 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static size_t mm_batch_alloc(trace_t *trace, int opnum);
+static void mm_batch_free(trace_t *trace, int opnum);
+static void *mm_aligned_alloc(trace_t *trace, int opnum);
+static size_t mm_block_usable(void *p);
+static void mm_counters(mm_stats_t *counters);
+static void mm_heap_growth(mm_growth_t *growth);
+static void mm_free_space(mm_heapinfo_t *info);
+static bool mm_heap_ok(void);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printcounters(int n, stats_t *stats);
+static void printheapstats(const stats_t *stats);
+static void printfreespace(const char *filename);
+static void printclasses(void);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -305,7 +349,6 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         trace_t *trace;
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
         strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0)
@@ -336,11 +379,17 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
+            mm_counters(&mm_stats[i].counters);
+            mm_heap_growth(&mm_stats[i].growth);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
+            {
                 printf("and performance.\n");
+                printheapstats(&mm_stats[i]);
+            }
+            printfreespace(trace->filename);
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
@@ -388,7 +437,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:F:P:hpBCOVAlDT")) != EOF)
     {
         switch (c)
         {
@@ -449,6 +498,18 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'B':
+            batch_mode = true;
+            break;
+
+        case 'F':
+            frag_samples = atoi(optarg);
+            break;
+
+        case 'P':
+            check_threads = atoi(optarg);
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -477,6 +538,10 @@ int main(int argc, char **argv)
         init_random_data();
     }
 
+    /* Sparse emulation is not thread safe, so its heap checks use one */
+    if (check_threads <= 0)
+        check_threads = sparse_mode ? 1 : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
     /* Initialize the timeout */
     if (set_timeout > 0)
     {
@@ -549,7 +614,10 @@ int main(int argc, char **argv)
      * Always run and evaluate the student's mm package
      */
     if (verbose > 1)
+    {
         printf("\nTesting mm malloc\n");
+        printclasses();
+    }
 
     /* Allocate the mm stats array, with one stats_t struct per tracefile */
     mm_stats = (stats_t *)calloc(num_global_tracefiles, sizeof(stats_t));
@@ -582,6 +650,7 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            printcounters(num_global_tracefiles, mm_stats);
         }
     }
 
@@ -806,11 +875,15 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))
+    /* The payload must lie within the extent of the heap, or of a single
+       region from mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_map(lo, size))
     {
-        malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
+        malloc_error(trace, opnum,
+                     "Payload (%p:%p) lies outside heap (%p:%p) and mapped "
+                     "regions",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return false;
     }
@@ -1016,9 +1089,13 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     char type[MAXLINE];
     int index;
     size_t size;
+    size_t align;
     int max_index = 0;
     int op_index;
     int ignore = 0;
+    int count;
+    int max_count = 1;
+    double requests = 0;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -1066,6 +1143,9 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
              calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    trace->batch_ids = NULL;
+    trace->num_batch_ids = 0;
+
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
@@ -1092,6 +1172,41 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %lu %lu", &index, &align, &size);
+            if (align == 0 || (align & (align - 1)) != 0)
+                app_error("%s: alignment %lu is not a power of two",
+                          trace->filename, align);
+            trace->ops[op_index].type = ALIGNED_ALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].align = align;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'A':
+            ignore += fscanf(tracefile, "%d %lu", &count, &size);
+            trace->ops[op_index].type = BATCH_ALLOC;
+            trace->ops[op_index].index = trace->num_batch_ids;
+            trace->ops[op_index].count = count;
+            trace->ops[op_index].size = size;
+            for (int i = 0; i < count; i++)
+            {
+                ignore += fscanf(tracefile, "%u", &index);
+                add_batch_id(trace, index);
+                max_index = (index > max_index) ? index : max_index;
+            }
+            break;
+        case 'F':
+            ignore += fscanf(tracefile, "%d", &count);
+            trace->ops[op_index].type = BATCH_FREE;
+            trace->ops[op_index].index = trace->num_batch_ids;
+            trace->ops[op_index].count = count;
+            for (int i = 0; i < count; i++)
+            {
+                ignore += fscanf(tracefile, "%u", &index);
+                add_batch_id(trace, index);
+            }
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                       trace->filename);
@@ -1104,14 +1219,100 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
+    /* a batch counts as one request per block */
+    for (op_index = 0; op_index < trace->num_ops; op_index++)
+    {
+        traceop_t *op = &trace->ops[op_index];
+        bool batch = op->type == BATCH_ALLOC || op->type == BATCH_FREE;
+        requests += batch ? op->count : 1;
+    }
+
+    if (batch_mode)
+        batch_trace(trace);
+
+    /* make room for the pointers of the largest batch */
+    for (op_index = 0; op_index < trace->num_ops; op_index++)
+    {
+        traceop_t *op = &trace->ops[op_index];
+        if ((op->type == BATCH_ALLOC || op->type == BATCH_FREE) &&
+            op->count > max_count)
+            max_count = op->count;
+    }
+    if ((trace->batch_ptrs = calloc(max_count, sizeof(char *))) == NULL)
+        unix_error("malloc 6 failed in read_trace");
+
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
+    stats->ops = requests;
 
     return trace;
 }
 
+/*
+ * add_batch_id - append a block id to the ids of the batch requests
+ */
+static void add_batch_id(trace_t *trace, int index)
+{
+    int n = trace->num_batch_ids;
+
+    /* grow the array whenever its size reaches a power of two */
+    if (n >= 16 && (n & (n - 1)) == 0)
+    {
+        trace->batch_ids = realloc(trace->batch_ids, 2 * n * sizeof(int));
+    }
+    else if (n == 0)
+    {
+        trace->batch_ids = malloc(16 * sizeof(int));
+    }
+    if (trace->batch_ids == NULL)
+        unix_error("malloc failed in add_batch_id");
+    trace->batch_ids[trace->num_batch_ids++] = index;
+}
+
+/*
+ * batch_trace - turn every run of consecutive mallocs of the same size,
+ *     and every run of consecutive frees, into a batch request
+ */
+static void batch_trace(trace_t *trace)
+{
+    traceop_t *ops = trace->ops;
+    int i = 0;
+    int num_ops = 0;
+
+    while (i < trace->num_ops)
+    {
+        traceop_t op = ops[i];
+        int j = i + 1;
+
+        if (op.type == ALLOC)
+        {
+            while (j < trace->num_ops && ops[j].type == ALLOC &&
+                   ops[j].size == op.size)
+                j++;
+        }
+        else if (op.type == FREE && op.index >= 0)
+        {
+            while (j < trace->num_ops && ops[j].type == FREE &&
+                   ops[j].index >= 0)
+                j++;
+        }
+
+        if (j - i > 1)
+        {
+            int first = trace->num_batch_ids;
+            for (int k = i; k < j; k++)
+                add_batch_id(trace, ops[k].index);
+            op.type = (op.type == ALLOC) ? BATCH_ALLOC : BATCH_FREE;
+            op.index = first;
+            op.count = j - i;
+        }
+        ops[num_ops++] = op;
+        i = j;
+    }
+    trace->num_ops = num_ops;
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -1132,6 +1333,8 @@ static void free_trace(trace_t *trace)
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->batch_ids);
+    free(trace->batch_ptrs);
     free(trace); /* and the trace record itself... */
 }
 
@@ -1140,13 +1343,132 @@ static void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * mm_batch_alloc - allocate the blocks of a batch request into
+ *     trace->batch_ptrs, returning how many were allocated.  The reference
+ *     allocator has no batch functions, so it gets one call per block.
+ */
+static size_t mm_batch_alloc(trace_t *trace, int opnum)
+{
+    traceop_t *op = &trace->ops[opnum];
+    void **ptrs = (void **)trace->batch_ptrs;
+#if REF_ONLY
+    size_t i;
+    for (i = 0; i < (size_t)op->count; i++)
+        if ((ptrs[i] = mm_malloc(op->size)) == NULL)
+            break;
+    return i;
+#else
+    return mm_malloc_batch(op->size, op->count, ptrs);
+#endif
+}
+
+/*
+ * mm_batch_free - free the blocks in trace->batch_ptrs for a batch request
+ */
+static void mm_batch_free(trace_t *trace, int opnum)
+{
+    traceop_t *op = &trace->ops[opnum];
+    void **ptrs = (void **)trace->batch_ptrs;
+#if REF_ONLY
+    for (int i = 0; i < op->count; i++)
+        mm_free(ptrs[i]);
+#else
+    mm_free_batch(op->count, ptrs);
+#endif
+}
+
+/*
+ * mm_aligned_alloc - allocate the block of an aligned alloc request.  The
+ *     reference allocator only knows the alignment of mm_malloc.
+ */
+static void *mm_aligned_alloc(trace_t *trace, int opnum)
+{
+    traceop_t *op = &trace->ops[opnum];
+#if REF_ONLY
+    if (op->align > ALIGNMENT)
+        app_error("%s: the reference allocator has no aligned allocation",
+                  trace->filename);
+    return mm_malloc(op->size);
+#else
+    return mm_memalign(op->align, op->size);
+#endif
+}
+
+/*
+ * mm_block_usable - the usable size of an allocated block, as reported by
+ *     mm_usable_size.  The reference allocator doesn't report it.
+ */
+static size_t mm_block_usable(void *p)
+{
+#if REF_ONLY
+    return 0;
+#else
+    return mm_usable_size(p);
+#endif
+}
+
+/*
+ * mm_counters - the hot-path counters since mm_init, as reported by
+ *     mm_stats.  The reference allocator doesn't keep them.
+ */
+static void mm_counters(mm_stats_t *counters)
+{
+#if REF_ONLY
+    memset(counters, 0, sizeof(*counters));
+#else
+    mm_stats(counters);
+#endif
+}
+
+/*
+ * mm_heap_growth - how the heap has grown, as reported by mm_growth.
+ *     The reference allocator doesn't report it.
+ */
+static void mm_heap_growth(mm_growth_t *growth)
+{
+#if REF_ONLY
+    memset(growth, 0, sizeof(*growth));
+#else
+    mm_growth(growth);
+#endif
+}
+
+/*
+ * mm_free_space - the free space in the heap, as reported by mm_heapinfo.
+ *     The reference allocator doesn't report it.
+ */
+static void mm_free_space(mm_heapinfo_t *info)
+{
+#if REF_ONLY
+    memset(info, 0, sizeof(*info));
+#else
+    mm_heapinfo(info);
+#endif
+}
+
+/*
+ * mm_heap_ok - check the whole heap, with mm_checkheap_parallel on
+ *     check_threads threads.  The reference allocator only has
+ *     mm_checkheap.
+ */
+static bool mm_heap_ok(void)
+{
+#if REF_ONLY
+    return mm_checkheap(0);
+#else
+    return mm_checkheap_parallel(0, check_threads);
+#endif
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
+    int i, j;
     int index;
+    int *ids;
     size_t size;
     char *newp;
     char *oldp;
@@ -1175,7 +1497,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             range_t *r;
 
             /* Let the students check their own heap */
-            if (!mm_checkheap(0))
+            if (!mm_heap_ok())
             {
                 malloc_error(trace, i, "mm_checkheap returned false\n");
                 return false;
@@ -1221,6 +1543,26 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             randomize_block(trace, index);
             break;
 
+        case ALIGNED_ALLOC: /* mm_memalign */
+            if ((p = mm_aligned_alloc(trace, i)) == NULL)
+            {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return false;
+            }
+            if ((unsigned long)p % trace->ops[i].align != 0)
+            {
+                malloc_error(trace, i,
+                             "Payload address (%p) not aligned to %zu bytes",
+                             p, trace->ops[i].align);
+                return false;
+            }
+            if (add_range(ranges, p, size, trace, i, index) == 0)
+                return false;
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
         case REALLOC: /* mm_realloc */
             if (!check_index(trace, i, index))
             {
@@ -1294,6 +1636,39 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             mm_free(p);
             break;
 
+        case BATCH_ALLOC: /* mm_malloc_batch */
+            ids = &trace->batch_ids[index];
+            if (mm_batch_alloc(trace, i) != (size_t)trace->ops[i].count)
+            {
+                malloc_error(trace, i, "mm_malloc_batch failed.");
+                return false;
+            }
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                p = trace->batch_ptrs[j];
+                if (add_range(ranges, p, size, trace, i, ids[j]) == 0)
+                    return false;
+                trace->blocks[ids[j]] = p;
+                trace->block_sizes[ids[j]] = size;
+                randomize_block(trace, ids[j]);
+            }
+            break;
+
+        case BATCH_FREE: /* mm_free_batch */
+            ids = &trace->batch_ids[index];
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                if (!check_index(trace, i, ids[j]))
+                {
+                    allCheck = false;
+                }
+                p = trace->blocks[ids[j]];
+                remove_range(ranges, p);
+                trace->batch_ptrs[j] = p;
+            }
+            mm_batch_free(trace, i);
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -1307,20 +1682,35 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size of the heap in bytes while running the student's malloc
+ *   package on the trace, counting any regions from mem_map. mem_sbrk()
+ *   can shrink the heap, so the heap size is sampled after every request,
+ *   and trims (requests after which the heap is smaller) are counted.
+ *   The usable sizes of the live blocks are added up too, which gives the
+ *   internal fragmentation at the high water mark. The free space is
+ *   sampled from mm_heapinfo at even intervals, to find when external
+ *   fragmentation peaks (and to keep for -F to print once the trace is
+ *   done, in free_samples). The trims and both
+ *   fragmentation numbers are left in stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
-    int i;
+    int i, j;
     int index;
+    int *ids;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
+    size_t total_usable = 0;
+    size_t peak_usable = 0;
+    size_t heap_size, last_heap_size, max_heap_size, footprint;
+    int trims = 0;
+    int sample_every = 0;
+    int peak_frag_op = 0;
+    double peak_frag = 0.0;
+    mm_heapinfo_t info;
     char *p;
     char *newp, *oldp;
 
@@ -1330,6 +1720,26 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     mem_reset_brk();
     if (!mm_init())
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+    last_heap_size = mem_heapsize();
+    max_heap_size = last_heap_size + mem_mapsize();
+
+    /* sample the free space frag_samples times, or 100 for its peak */
+    if (frag_samples > 0 || verbose > 1)
+    {
+        int samples = frag_samples > 0 ? frag_samples : 100;
+        sample_every = trace->num_ops / samples;
+        if (sample_every < 1)
+            sample_every = 1;
+    }
+    num_free_samples = 0;
+    if (frag_samples > 0)
+    {
+        free(free_samples);
+        free_samples =
+            malloc((trace->num_ops / sample_every + 1) * sizeof(free_sample_t));
+        if (free_samples == NULL)
+            unix_error("malloc failed in eval_mm_util");
+    }
 
     for (i = 0; i < trace->num_ops; i++)
     {
@@ -1351,6 +1761,24 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             trace->block_sizes[index] = size;
 
             total_size += size;
+            total_usable += mm_block_usable(p);
+            break;
+
+        case ALIGNED_ALLOC: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if ((p = mm_aligned_alloc(trace, i)) == NULL)
+            {
+                app_error("trace %d: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            total_usable += mm_block_usable(p);
             break;
 
         case REALLOC: /* mm_realloc */
@@ -1359,6 +1787,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             oldsize = trace->block_sizes[index];
 
             oldp = trace->blocks[index];
+            total_usable -= mm_block_usable(oldp);
             setUBCheck(false);
             if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
             {
@@ -1372,6 +1801,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             trace->block_sizes[index] = newsize;
 
             total_size += (newsize - oldsize);
+            total_usable += mm_block_usable(newp);
             break;
 
         case FREE: /* mm_free */
@@ -1387,26 +1817,92 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
+            total_usable -= mm_block_usable(p);
             mm_free(p);
 
             total_size -= size;
             break;
 
+        case BATCH_ALLOC: /* mm_malloc_batch */
+            ids = &trace->batch_ids[trace->ops[i].index];
+            size = trace->ops[i].size;
+            if (mm_batch_alloc(trace, i) != (size_t)trace->ops[i].count)
+            {
+                app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+            }
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                trace->blocks[ids[j]] = trace->batch_ptrs[j];
+                trace->block_sizes[ids[j]] = size;
+                total_size += size;
+                total_usable += mm_block_usable(trace->batch_ptrs[j]);
+            }
+            break;
+
+        case BATCH_FREE: /* mm_free_batch */
+            ids = &trace->batch_ids[trace->ops[i].index];
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                trace->batch_ptrs[j] = trace->blocks[ids[j]];
+                total_size -= trace->block_sizes[ids[j]];
+                total_usable -= mm_block_usable(trace->batch_ptrs[j]);
+            }
+            mm_batch_free(trace, i);
+            break;
+
         default:
             app_error("trace %d: Nonexistent request type in eval_mm_util",
                       tracenum);
         }
 
-        /* update the high-water mark */
-        max_total_size =
-            (total_size > max_total_size) ? total_size : max_total_size;
+        /* update the high-water mark, and the usable bytes there */
+        if (total_size > max_total_size)
+        {
+            max_total_size = total_size;
+            peak_usable = total_usable;
+        }
+
+        /* and the heap's, noting any trim */
+        heap_size = mem_heapsize();
+        if (heap_size < last_heap_size)
+            trims++;
+        last_heap_size = heap_size;
+        footprint = heap_size + mem_mapsize();
+        max_heap_size = (footprint > max_heap_size) ? footprint : max_heap_size;
+
+        /* and, every so often, how fragmented its free space is */
+        if (sample_every > 0 && (i + 1) % sample_every == 0)
+        {
+            mm_free_space(&info);
+            if (info.frag > peak_frag)
+            {
+                peak_frag = info.frag;
+                peak_frag_op = i + 1;
+            }
+            if (frag_samples > 0)
+            {
+                free_sample_t *sample = &free_samples[num_free_samples++];
+                sample->op = i + 1;
+                sample->heap_size = heap_size;
+                sample->info = info;
+            }
+        }
     }
 
 #if !REF_ONLY
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->trims = trims;
+    stats->int_frag = 0.0;
+    if (peak_usable > 0)
+        stats->int_frag = (double)(peak_usable - max_total_size) /
+                          (double)peak_usable;
+    stats->peak_frag = peak_frag;
+    stats->peak_frag_op = peak_frag_op;
+
+    return ((double)max_total_size / (double)max_heap_size);
 }
 
 /*
@@ -1415,7 +1911,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
+    int i, j, index;
+    int *ids;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
@@ -1439,6 +1936,13 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case ALIGNED_ALLOC: /* mm_memalign */
+            index = trace->ops[i].index;
+            if ((p = mm_aligned_alloc(trace, i)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1463,6 +1967,21 @@ static void eval_mm_speed(void *ptr)
             mm_free(block);
             break;
 
+        case BATCH_ALLOC: /* mm_malloc_batch */
+            ids = &trace->batch_ids[trace->ops[i].index];
+            if (mm_batch_alloc(trace, i) != (size_t)trace->ops[i].count)
+                app_error("mm_malloc_batch error in eval_mm_speed");
+            for (j = 0; j < trace->ops[i].count; j++)
+                trace->blocks[ids[j]] = trace->batch_ptrs[j];
+            break;
+
+        case BATCH_FREE: /* mm_free_batch */
+            ids = &trace->batch_ids[trace->ops[i].index];
+            for (j = 0; j < trace->ops[i].count; j++)
+                trace->batch_ptrs[j] = trace->blocks[ids[j]];
+            mm_batch_free(trace, i);
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_speed");
         }
@@ -1476,9 +1995,11 @@ static void eval_mm_speed(void *ptr)
  */
 static bool eval_libc_valid(trace_t *trace)
 {
-    int i;
+    int i, j;
+    int *ids;
     size_t newsize;
     char *p, *newp, *oldp;
+    void *q;
 
     reinit_trace(trace);
 
@@ -1496,6 +2017,15 @@ static bool eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case ALIGNED_ALLOC: /* posix_memalign */
+            if (posix_memalign(&q, trace->ops[i].align, trace->ops[i].size))
+            {
+                malloc_error(trace, i, "libc posix_memalign failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = q;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1518,6 +2048,25 @@ static bool eval_libc_valid(trace_t *trace)
             }
             break;
 
+        case BATCH_ALLOC: /* malloc, once per block */
+            ids = &trace->batch_ids[trace->ops[i].index];
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                if ((p = malloc(trace->ops[i].size)) == NULL)
+                {
+                    malloc_error(trace, i, "libc malloc failed");
+                    unix_error("System message");
+                }
+                trace->blocks[ids[j]] = p;
+            }
+            break;
+
+        case BATCH_FREE: /* free, once per block */
+            ids = &trace->batch_ids[trace->ops[i].index];
+            for (j = 0; j < trace->ops[i].count; j++)
+                free(trace->blocks[ids[j]]);
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1533,10 +2082,12 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index;
+    int *ids;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
+    void *q;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     reinit_trace(trace);
@@ -1553,6 +2104,13 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case ALIGNED_ALLOC: /* posix_memalign */
+            index = trace->ops[i].index;
+            if (posix_memalign(&q, trace->ops[i].align, trace->ops[i].size))
+                unix_error("posix_memalign failed in eval_libc_speed");
+            trace->blocks[index] = q;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1575,6 +2133,22 @@ static void eval_libc_speed(void *ptr)
                 free(0);
             }
             break;
+
+        case BATCH_ALLOC: /* malloc, once per block */
+            ids = &trace->batch_ids[trace->ops[i].index];
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                if ((p = malloc(trace->ops[i].size)) == NULL)
+                    unix_error("malloc failed in eval_libc_speed");
+                trace->blocks[ids[j]] = p;
+            }
+            break;
+
+        case BATCH_FREE: /* free, once per block */
+            ids = &trace->batch_ids[trace->ops[i].index];
+            for (j = 0; j < trace->ops[i].count; j++)
+                free(trace->blocks[ids[j]]);
+            break;
         }
     }
 }
@@ -1761,6 +2335,135 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * printcounters - Print the hot-path counters of each valid trace, if
+ *     the mm package was built to keep them (mdriver-stats)
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    int i;
+    bool any = false;
+
+    for (i = 0; i < n; i++)
+        any = any || (stats[i].valid && stats[i].counters.enabled);
+    if (!any)
+        return;
+
+    printf("Hot-path counters for mm malloc:\n");
+    if (tab_mode)
+    {
+        printf("fits	lists	nodes	capped	splits	coal1	coal2	coal3	"
+               "coal4	extends	extbytes\ttrace\n");
+    }
+    else
+    {
+        printf("%9s%10s%10s%8s%9s%9s%9s%9s%9s%6s%8s  %s\n", "fits",
+               "lists/fit", "nodes/fit", "capped", "splits", "co-both",
+               "co-prev", "co-next", "co-none", "ext", "extKB", "trace");
+    }
+    for (i = 0; i < n; i++)
+    {
+        mm_stats_t *c = &stats[i].counters;
+        if (!stats[i].valid || !c->enabled)
+            continue;
+
+        /* lists and nodes are per fit search */
+        double fits = c->fits > 0 ? (double)c->fits : 1.0;
+        if (tab_mode)
+        {
+            printf("%zu	%.2f	%.2f	%zu	%zu	%zu	%zu	%zu	%zu	%zu	%zu"
+                   "	%s\n",
+                   c->fits, (double)c->lists / fits, (double)c->nodes / fits,
+                   c->capped, c->splits, c->coalesce[0], c->coalesce[1],
+                   c->coalesce[2], c->coalesce[3], c->extends,
+                   c->extend_bytes, stats[i].filename);
+        }
+        else
+        {
+            printf("%9zu%10.2f%10.2f%8zu%9zu%9zu%9zu%9zu%9zu%6zu%8zu  %s\n",
+                   c->fits, (double)c->lists / fits, (double)c->nodes / fits,
+                   c->capped, c->splits, c->coalesce[0], c->coalesce[1],
+                   c->coalesce[2], c->coalesce[3], c->extends,
+                   c->extend_bytes / 1024, stats[i].filename);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * printheapstats - Print, on a line of its own, how the heap grew and
+ *     how fragmented it got during the utilization run of a trace.  The
+ *     reference allocator doesn't report them.
+ */
+static void printheapstats(const stats_t *stats)
+{
+#if !REF_ONLY
+    const mm_growth_t *growth = &stats->growth;
+
+    printf("%zu heap extensions (%zu bytes, %s step of %zu), "
+           "%.1f%% internal fragmentation at peak",
+           growth->count, growth->bytes,
+           growth->adaptive ? "adaptive" : "fixed", growth->step,
+           100.0 * stats->int_frag);
+    if (stats->peak_frag_op > 0)
+        printf(", %.1f%% external fragmentation at op %d",
+               100.0 * stats->peak_frag, stats->peak_frag_op);
+    if (stats->trims > 0)
+        printf(", %d heap trims", stats->trims);
+    printf(".\n");
+#endif
+}
+
+/*
+ * printfreespace - Print the free space sampled during the utilization
+ *     run of a trace, for -F.  It is printed once the trace's progress
+ *     line is done, so the table starts on a line of its own.
+ */
+static void printfreespace(const char *filename)
+{
+    int i;
+
+    if (frag_samples <= 0)
+        return;
+
+    printf("\nFree space during %s:\n%9s%9s%9s%8s%10s%7s%9s%7s\n",
+           filename, "op", "heapKB", "freeKB", "blocks", "largestKB", "topKB",
+           "cachedKB", "frag");
+    for (i = 0; i < num_free_samples; i++)
+    {
+        const free_sample_t *sample = &free_samples[i];
+        const mm_heapinfo_t *info = &sample->info;
+        printf("%9d%9zu%9zu%8zu%10zu%7zu%9zu%6.1f%%\n", sample->op,
+               sample->heap_size / 1024, info->free_bytes / 1024,
+               info->free_blocks, info->largest / 1024, info->top / 1024,
+               info->cached_bytes / 1024, 100.0 * info->frag);
+    }
+    num_free_samples = 0;
+}
+
+/*
+ * printclasses - Print the smallest block size of each free list size
+ *     class of the mm package, as reported by mm_heapinfo
+ */
+static void printclasses(void)
+{
+    mm_heapinfo_t info;
+    int i;
+
+    mem_init(sparse_mode);
+    if (!mm_init())
+        app_error("mm_init failed in printclasses");
+    mm_free_space(&info);
+    mem_deinit();
+
+    if (info.class_min[0] == 0)
+        return;
+    printf("Size classes from:");
+    for (i = 0; i < mm_class_count; i++)
+        printf(" %zu", info.class_min[i]);
+    printf(" bytes\n");
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -2013,8 +2716,10 @@ static double measure_ref_throughput(bool checkpoint)
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVBCdD] [-f <file>]\n", prog);
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-B         Replay runs of same-size mallocs and of "
+                    "frees as batches.\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -2028,4 +2733,7 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-F <n>     Print the free space n times per trace\n");
+    fprintf(stderr, "\t-P <n>     Check the heap on n threads with -D "
+                    "(default one per CPU)\n");
 }
@@ -4,53 +4,156 @@
  *
  * This file allows compiling student malloc implementations so that they can
  * be used as an interpositioning library, and thereby run actual programs.
+ *
+ * Each heap lives in its own address range, reserved with mmap rather than
+ * behind the program break, so it does not clash with other users of sbrk,
+ * and pages are made accessible as it grows.  All MEM_HEAPS ranges come from
+ * one reservation, so the heap holding an address is found by division.
+ * The calling thread picks the heap that mem_sbrk and friends act on with
+ * mem_use_heap.  None of these functions lock; the allocator must serialize
+ * its calls on each heap.
  */
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "memlib.h"
 
+/* Number of heaps, and the size of the address range reserved for each */
+#define MEM_HEAPS 64
+#define HEAP_RESERVE (1UL << 36)
+
+/* The state of one heap */
+typedef struct {
+    unsigned char *start;    /* Starting address of heap */
+    unsigned char *brk;      /* Current position of break */
+    unsigned char *max_brk;  /* Highest break so far */
+    unsigned char *top;      /* End of the accessible pages */
+} mem_heap_t;
+
 /* private global variables */
-static bool init = false;
-static unsigned char *heap;         /* Starting address of heap */
-static unsigned char *mem_brk;      /* Current position of break */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static unsigned char *base;             /* Start of the reservation */
+static mem_heap_t heaps[MEM_HEAPS];
+static __thread size_t heap_id = 0;     /* Heap the thread works on */
+static size_t mapped_bytes = 0;         /* Total size of mapped regions */
 
-static void ensure_init(void) {
-    if (!init) {
-        mem_brk = heap = sbrk(0);
-        assert(mem_brk != (void *)-1);
-        init = true;
+static void init(void) {
+    base = mmap(NULL, MEM_HEAPS * HEAP_RESERVE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(base != MAP_FAILED);
+    for (size_t i = 0; i < MEM_HEAPS; i++) {
+        mem_heap_t *h = &heaps[i];
+        h->start = h->brk = h->max_brk = h->top = base + i * HEAP_RESERVE;
     }
 }
 
+/* Return the heap of the calling thread */
+static mem_heap_t *cur_heap(void) {
+    pthread_once(&init_once, init);
+    return &heaps[heap_id];
+}
+
 void *mem_sbrk(intptr_t incr) {
-    ensure_init();
+    mem_heap_t *h = cur_heap();
+
+    /* The heap can't shrink below its start, or grow past its reserve */
+    if (incr < 0 && (size_t)-incr > (size_t)(h->brk - h->start)) {
+        return (void *)-1;
+    }
+    if (incr > 0 &&
+        (size_t)incr > HEAP_RESERVE - (size_t)(h->brk - h->start)) {
+        return (void *)-1;
+    }
+
+    unsigned char *res = h->brk;
+    size_t pagesize = mem_pagesize();
+    size_t used = (size_t)(h->brk + incr - h->start);
+    unsigned char *top =
+        h->start + (used + pagesize - 1) / pagesize * pagesize;
 
-    unsigned char *res = sbrk(incr);
-    if (res == (void *)-1) {
-        return res;
+    if (top > h->top) {
+        if (mprotect(h->top, (size_t)(top - h->top),
+                     PROT_READ | PROT_WRITE) != 0) {
+            return (void *)-1;
+        }
+    } else if (top < h->top) {
+        /* Replace the released pages, giving them back to the kernel */
+        if (mmap(top, (size_t)(h->top - top), PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+                 0) == MAP_FAILED) {
+            return (void *)-1;
+        }
     }
 
-    assert(res == mem_brk);
-    mem_brk += incr;
+    h->top = top;
+    h->brk += incr;
+    if (h->brk > h->max_brk) {
+        h->max_brk = h->brk;
+    }
     return (void *) res;
 }
 
 void *mem_heap_lo(void) {
-    ensure_init();
-    return (void *)heap;
+    return (void *)cur_heap()->start;
 }
 
 void *mem_heap_hi(void) {
-    ensure_init();
-    return (void *)(mem_brk - 1);
+    return (void *)(cur_heap()->brk - 1);
+}
+
+void *mem_zero_lo(void) {
+    /* Fresh memory from the kernel is zero */
+    return (void *)cur_heap()->max_brk;
+}
+
+size_t mem_heaps(void) {
+    return MEM_HEAPS;
+}
+
+void mem_use_heap(size_t id) {
+    assert(id < MEM_HEAPS);
+    heap_id = id;
+}
+
+int mem_heap_id(const void *addr) {
+    pthread_once(&init_once, init);
+    size_t offset = (size_t)((const unsigned char *)addr - base);
+    if ((const unsigned char *)addr < base ||
+        offset >= MEM_HEAPS * HEAP_RESERVE) {
+        return -1;
+    }
+    return (int)(offset / HEAP_RESERVE);
+}
+
+void *mem_map(size_t size) {
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return (void *)-1;
+    }
+    __atomic_add_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+    return addr;
+}
+
+int mem_unmap(void *addr, size_t size) {
+    if (munmap(addr, size) != 0) {
+        return -1;
+    }
+    __atomic_sub_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+size_t mem_mapsize(void) {
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
 }
 
 size_t mem_heapsize(void) {
-    ensure_init();
-    return (size_t)(mem_brk - heap);
+    mem_heap_t *h = cur_heap();
+    return (size_t)(h->brk - h->start);
 }
 
 size_t mem_pagesize(void) {
@@ -24,13 +24,20 @@
  * Loading from the sparse emulation uses the above lookup and then aggregates
  *  the data into a return value.
  *
+ * Regions from mem_map are emulated the same way.  They are given addresses
+ *  from a range just above the largest possible heap, which are never
+ *  reused, and their pages read as zero.  Each region keeps a list of the
+ *  pages it has touched, which mem_unmap takes out of the page table and
+ *  puts on a list of free pages for get_mem to use first.
+ *
  * If an emulated access is made to an address outside of the current
- *  bounds (mem_heap_lo, mem_heap_hi), then the address is assumed to be to
- *  a non-heap location, such as stack, global variables, etc.  For some
- *  implementations, this access is meant to be to the heap and was "safe"
- *  in non-emulation, as it was to the same page as actual heap data.  But
- *  sparse emulation has tighter checks.  Commonly, the CPU reports a
- *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
+ *  bounds (mem_heap_lo, mem_heap_hi) and of the mapped regions, then the
+ *  address is assumed to be to a non-heap location, such as stack, global
+ *  variables, etc.  For some implementations, this access is meant to be
+ *  to the heap and was "safe" in non-emulation, as it was to the same page
+ *  as actual heap data.  But sparse emulation has tighter checks.
+ *  Commonly, the CPU reports a BUS ERROR on these accesses, and should be
+ *  debugged as segmentation faults.
  */
 #include <assert.h>
 #include <errno.h>
@@ -53,12 +60,14 @@ void markGlobalsUninit(void);
 
 #include "config.h"
 #include "memlib.h"
+#include "stree.h"
 
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK
 {
     size_t id;         /* Page ID.  Counts number of pages from start of heap */
-    struct MBLK *next; /* Link for hash table */
+    struct MBLK *next; /* Link for hash table, or for the free page list */
+    struct MBLK *next_in_region; /* Link for the pages of a mapped region */
     unsigned char initSet[SPARSE_PAGE_SIZE / 8];
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
@@ -67,6 +76,7 @@ typedef struct MBLK
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static unsigned char *mem_max_brk;  /* Highest break since mem_init */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
@@ -75,8 +85,22 @@ static bool show_stats =
 static bool stats_printed =
     false; /* Has information been printed about allocation */
 
+/* Regions from mem_map */
+typedef struct
+{
+    unsigned char *addr; /* Start of region */
+    size_t size;         /* Length of region */
+    mem_block_t *pages;  /* Emulation pages of the region, in sparse mode */
+} mem_region_t;
+
+static tree_t *regions = NULL;      /* Mapped regions keyed by address */
+static size_t mapped_bytes = 0;     /* Total size of mapped regions */
+static unsigned char *map_base;     /* Start of emulated region addresses */
+static unsigned char *map_brk;      /* Next emulated region address */
+
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL; /* Next free page */
+static mem_block_t *freed_pages = NULL;    /* Pages of unmapped regions */
 static size_t num_pages = 0;               /* Total number of pages */
 static size_t num_free_pages = 0;          /* Number of free pages */
 static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
@@ -114,6 +138,8 @@ static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
 static void print_stats();
+static void unmap_all(void);
+static bool emulated(const void *addr, size_t len);
 
 /*
  * mem_init - initialize the memory system model
@@ -173,6 +199,10 @@ void mem_init(bool do_sparse)
     }
     stats_printed = false;
     mem_brk = heap;
+    mem_max_brk = heap;
+    regions = tree_new();
+    mapped_bytes = 0;
+    map_base = map_brk = heap + MAX_SPARSE_HEAP;
 }
 
 /*
@@ -181,8 +211,10 @@ void mem_init(bool do_sparse)
 void mem_deinit(void)
 {
     print_stats();
+    unmap_all();
     munmap(heap, mmap_length);
     next_free_page = NULL;
+    freed_pages = NULL;
     num_free_pages = 0;
     page_table = NULL;
     num_buckets = 0;
@@ -201,6 +233,7 @@ void mem_reset_brk()
         memset((void *)page_table, 0, ptb);
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
+        freed_pages = NULL;
         num_free_pages = num_pages;
     }
     else
@@ -218,25 +251,30 @@ void mem_reset_brk()
 #endif
     }
     mem_brk = heap;
+    unmap_all();
+    regions = tree_new();
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap, but not below its start.  Sparse pages
+ *  above the new break are kept and reused if the heap grows again.  The
+ *  real break is never lowered: the driver's own malloc may be using the
+ *  memory above it.
  */
 void *mem_sbrk(intptr_t incr)
 {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0)
+    if (incr < 0 && (size_t)-incr > (size_t)(mem_brk - heap))
     {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                "bytes, more than its size %zd\n",
+                (long)-incr, (size_t)(mem_brk - heap));
     }
     else if (mem_brk + incr > mem_max_addr)
     {
@@ -247,7 +285,7 @@ void *mem_sbrk(intptr_t incr)
                 "heap size of %zd (0x%zx) bytes\n",
                 alloc, alloc);
     }
-    else if (!sparse && sbrk(incr) == (void *)-1)
+    else if (!sparse && incr > 0 && sbrk(incr) == (void *)-1)
     {
         ok = false;
         fprintf(
@@ -258,10 +296,16 @@ void *mem_sbrk(intptr_t incr)
     if (ok)
     {
 #ifdef USE_ASAN
-        /* Mark the extended section of the heap as addressable */
-        __asan_unpoison_memory_region(mem_brk, incr);
+        if (incr < 0)
+            /* Mark the released section of the heap as unaddressable */
+            __asan_poison_memory_region(mem_brk + incr, -incr);
+        else
+            /* Mark the extended section of the heap as addressable */
+            __asan_unpoison_memory_region(mem_brk, incr);
 #endif
         mem_brk += incr;
+        if (mem_brk > mem_max_brk)
+            mem_max_brk = mem_brk;
         return (void *)old_brk;
     }
     else
@@ -271,6 +315,140 @@ void *mem_sbrk(intptr_t incr)
     }
 }
 
+/*
+ * mem_map - map a zero-filled region apart from the heap.  Dense mode uses
+ *  an anonymous mapping; sparse mode hands out the next range of emulated
+ *  addresses above the heap.
+ */
+void *mem_map(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size_t len = (size + pagesize - 1) / pagesize * pagesize;
+    unsigned char *addr;
+
+    if (size == 0 || len < size)
+    {
+        errno = EINVAL;
+        return (void *)-1;
+    }
+    if (sparse)
+    {
+        if (len > (size_t)(map_base + MAX_SPARSE_MAP - map_brk))
+        {
+            fprintf(stderr,
+                    "ERROR: mem_map failed.  Ran out of emulated address "
+                    "space for %zd (0x%zx) bytes\n",
+                    size, size);
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        addr = map_brk;
+        map_brk += len;
+    }
+    else
+    {
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            return (void *)-1;
+    }
+
+    mem_region_t *r = malloc(sizeof(mem_region_t));
+    if (r == NULL)
+    {
+        if (!sparse)
+            munmap(addr, len);
+        return (void *)-1;
+    }
+    r->addr = addr;
+    r->size = len;
+    r->pages = NULL;
+    tree_insert(regions, (tkey_t)addr, r);
+    mapped_bytes += len;
+    return (void *)addr;
+}
+
+/*
+ * mem_unmap - release a region from mem_map.  In sparse mode the pages of
+ *  the region go back to the free pages, so emulation memory tracks the
+ *  regions in use rather than every region ever mapped.
+ */
+int mem_unmap(void *addr, size_t size)
+{
+    mem_region_t *r = tree_remove(regions, (tkey_t)addr);
+    if (r == NULL)
+    {
+        fprintf(stderr, "ERROR: mem_unmap failed.  %p is not a mapped "
+                        "region\n",
+                addr);
+        return -1;
+    }
+    if (!sparse)
+        munmap(r->addr, r->size);
+    while (r->pages != NULL)
+    {
+        mem_block_t *block = r->pages;
+        r->pages = block->next_in_region;
+        mem_block_t **link = &page_table[block->id % num_buckets];
+        while (*link != block)
+            link = &(*link)->next;
+        *link = block->next;
+        block->next = freed_pages;
+        freed_pages = block;
+        num_free_pages++;
+    }
+    mapped_bytes -= r->size;
+    free(r);
+    (void)size;
+    return 0;
+}
+
+/*
+ * mem_mapsize - return the total size of the mapped regions
+ */
+size_t mem_mapsize()
+{
+    return mapped_bytes;
+}
+
+/*
+ * mem_in_map - check that [addr, addr + len) is inside one mapped region
+ */
+bool mem_in_map(const void *addr, size_t len)
+{
+    mem_region_t *r = tree_find_nearest(regions, (tkey_t)addr);
+    return r != NULL && (unsigned char *)addr + len <= r->addr + r->size;
+}
+
+/*
+ * mem_heaps - return the number of heaps; the model has only one
+ */
+size_t mem_heaps()
+{
+    return 1;
+}
+
+/*
+ * mem_use_heap - select the heap for later calls; only heap 0 exists
+ */
+void mem_use_heap(size_t id)
+{
+    if (id != 0)
+    {
+        fprintf(stderr, "ERROR: mem_use_heap failed.  No heap %zd\n", id);
+        exit(1);
+    }
+}
+
+/*
+ * mem_heap_id - return 0 for an address within the heap, else -1
+ */
+int mem_heap_id(const void *addr)
+{
+    const unsigned char *a = addr;
+    return (a >= heap && a < mem_max_addr) ? 0 : -1;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -287,6 +465,20 @@ void *mem_heap_hi()
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_zero_lo - return the lowest address from which the heap area is
+ *  still zero.  The dense heap is a private mapping of /dev/zero and
+ *  mem_reset_brk does not clear it, so only bytes above the highest break
+ *  so far qualify.  Sparse pages are recycled without clearing, so nothing
+ *  is known to be zero there.
+ */
+void *mem_zero_lo()
+{
+    if (sparse)
+        return (void *)mem_max_addr;
+    return (void *)mem_max_brk;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -323,8 +515,7 @@ void mem_write128(void *addr, __int128 val)
 uint64_t mem_read(const void *addr, size_t len)
 {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (emulated(addr, len))
     {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
@@ -367,8 +558,7 @@ uint64_t mem_read(const void *addr, size_t len)
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len)
 {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (emulated(addr, len))
     {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
@@ -487,6 +677,33 @@ void hprobe(void *ptr, int offset, size_t count)
 
 /*************** Private Functions *******************/
 
+/* Release one mapped region record, and its mapping in dense mode */
+static void free_region(void *record)
+{
+    mem_region_t *r = record;
+    if (!sparse)
+        munmap(r->addr, r->size);
+    free(r);
+}
+
+/* Release every mapped region */
+static void unmap_all(void)
+{
+    if (regions != NULL)
+        tree_free(regions, free_region);
+    regions = NULL;
+    mapped_bytes = 0;
+    map_brk = map_base;
+}
+
+/* Is an access to be emulated, i.e. within the heap or the mapped range? */
+static bool emulated(const void *addr, size_t len)
+{
+    const unsigned char *a = addr;
+    return sparse && ((a >= heap && a + len <= mem_brk) ||
+                      (a >= map_base && a + len <= map_brk));
+}
+
 static void print_stats()
 {
     size_t vbytes = mem_heapsize();
@@ -547,12 +764,35 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
             fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
             exit(1);
         }
-        block = next_free_page++;
+        if (freed_pages != NULL)
+        {
+            block = freed_pages;
+            freed_pages = block->next;
+        }
+        else
+            block = next_free_page++;
         num_free_pages--;
         block->id = id;
         block->next = page_table[b];
-        for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
-            block->initSet[i] = 0;
+        block->next_in_region = NULL;
+        if ((unsigned char *)page_start(id) >= map_base)
+        {
+            /* Mapped pages start out as zero, like a fresh mapping */
+            memset(block->bytes, 0, SPARSE_PAGE_SIZE);
+            memset(block->initSet, 0xFF, SPARSE_PAGE_SIZE / 8);
+            /* and go back to the free pages when the region is unmapped */
+            mem_region_t *r = tree_find_nearest(regions, (tkey_t)addr);
+            if (r != NULL && (unsigned char *)addr < r->addr + r->size)
+            {
+                block->next_in_region = r->pages;
+                r->pages = block;
+            }
+        }
+        else
+        {
+            for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
+                block->initSet[i] = 0;
+        }
         page_table[b] = block;
     }
 
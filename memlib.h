@@ -22,15 +22,15 @@ void mem_init(bool sparse);
 void mem_deinit(void);
 
 /**
- * @brief Extends the heap by incr bytes.
+ * @brief Extends the heap by incr bytes, or shrinks it if incr is negative.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. The heap cannot
+ * be shrunk below its start.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `mem_heapsize() + incr >= 0`
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -39,6 +39,34 @@ void *mem_sbrk(intptr_t incr);
  */
 void mem_reset_brk(void);
 
+/**
+ * @brief Returns how many separate heaps are available.
+ *
+ * Each heap has its own break. The driver's memlib has one heap;
+ * memlib-passthrough.c has one per arena of the interposed allocator.
+ *
+ * @return The number of heaps, numbered from 0
+ */
+size_t mem_heaps(void);
+
+/**
+ * @brief Directs this thread's later heap calls to one of the heaps.
+ *
+ * mem_sbrk, mem_heap_lo, mem_heap_hi, mem_zero_lo and mem_heapsize act on
+ * the selected heap, which is heap 0 until this is called.
+ *
+ * @param[in] id The heap to use
+ * @pre `id < mem_heaps()`
+ */
+void mem_use_heap(size_t id);
+
+/**
+ * @brief Finds which heap an address lies in, in constant time.
+ * @param[in] addr The address
+ * @return The number of the heap whose reserved range holds addr, or -1
+ */
+int mem_heap_id(const void *addr);
+
 /**
  * @brief Finds the low address of the heap.
  * @return The address of the first valid byte in the heap.
@@ -55,6 +83,51 @@ void *mem_heap_lo(void);
  */
 void *mem_heap_hi(void);
 
+/**
+ * @brief Finds the lowest address from which the heap is known to be zero.
+ *
+ * Every byte from this address up to the end of the heap area, including
+ * any space a later mem_sbrk hands out, has never been part of the heap and
+ * still reads as zero. Returns an address past any possible heap when
+ * nothing is known to be zero.
+ *
+ * @return The start of the never-used part of the heap area
+ */
+void *mem_zero_lo(void);
+
+/**
+ * @brief Maps a new region of memory, apart from the heap.
+ *
+ * The region is page aligned, reads as zero, and stays valid until it is
+ * passed to mem_unmap. In sparse mode it is emulated like the heap.
+ *
+ * @param[in] size The size of the region in bytes
+ * @return The start address of the region, or (void *)-1 on failure
+ */
+void *mem_map(size_t size);
+
+/**
+ * @brief Unmaps a region returned by mem_map.
+ * @param[in] addr The start address of the region
+ * @param[in] size The size the region was mapped with
+ * @return 0 on success, -1 if addr does not start a mapped region
+ */
+int mem_unmap(void *addr, size_t size);
+
+/**
+ * @brief Returns the number of bytes in mapped regions.
+ * @return The total size of the regions currently mapped, in bytes
+ */
+size_t mem_mapsize(void);
+
+/**
+ * @brief Checks whether a range of addresses lies in one mapped region.
+ * @param[in] addr The first address of the range
+ * @param[in] len  The length of the range in bytes
+ * @return true if [addr, addr + len) is inside a single mapped region
+ */
+bool mem_in_map(const void *addr, size_t len);
+
 /**
  * @brief Returns the number of bytes being used by the heap.
  * @return The size of the heap, in bytes
@@ -0,0 +1,227 @@
+#!/usr/bin/perl
+use Getopt::Std;
+
+##############################################################################
+#
+# This program derives the free list size classes of mm.c from the request
+# sizes in a set of traces, and writes them as a C header (mm-classes.h).
+#
+# mm.c has 14 classes: class 0 holds the 16-byte mini blocks, classes 1 to
+# 12 are lists, and class 13 is the tree of blocks above 32768 bytes. The
+# program chooses the upper bounds of classes 1 to 11; the others are fixed.
+# 128 bytes, the largest fast bin size, is always a bound, so the blocks
+# that fast bins consolidate share no list with larger ones.
+#
+# Each list is charged, for every request that falls in it, the expected
+# number of blocks looked at before one is large enough (at most
+# searchtime) plus the expected slack of that block relative to the
+# request. The free blocks in a class are assumed to have the sizes of the
+# requests in it. The bounds that minimize the total charge are found by
+# dynamic programming over a grid of candidates: every 16 bytes up to 1024,
+# then eight steps per power of two.
+#
+##############################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-v] [-r RATIO] [-o OUTFILE] TRACE...\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h               Print this message\n";
+    printf STDERR "  -v               Print the classes and their costs\n";
+    printf STDERR "  -r RATIO         Widest list, largest over smallest size (default 2)\n";
+    printf STDERR "  -o OUTFILE       Write the header to OUTFILE (default stdout)\n";
+    die "\n";
+}
+
+getopts('hvo:r:');
+
+if ($opt_h) {
+    usage($ARGV[0]);
+}
+if (@ARGV == 0) {
+    usage("No traces given");
+}
+
+# Parameters, which must agree with mm.c
+$dsize = 16;
+$wsize = 8;
+$nclasses = 14;
+$tree_min = 32768;      # largest size of the last list
+$searchtime = 16;       # cap on the blocks looked at in a list
+$fast_max = 128;        # largest fast bin size, always a bound
+$nbuckets = $tree_min / $dsize;
+
+# No list spans more than this factor from its smallest to its largest size
+$ratio = $opt_r ? $opt_r : 2;
+
+# Histogram of adjusted sizes, in dsize buckets: $hist[b] holds the weight
+# of size (b + 1) * dsize. Each trace has the same total weight, so long
+# traces don't drown out short ones.
+@hist = (0) x ($nbuckets + 1);
+foreach $trace (@ARGV) {
+    open(TRACE, "<", $trace) || die "Couldn't open trace file '$trace'\n";
+    # skip weight, num_ids, num_ops and max_alloc
+    $header = 0;
+    %count = ();
+    $requests = 0;
+    while (<TRACE>) {
+        @f = split;
+        next if @f == 0;
+        if ($header < 4) {
+            $header++;
+            next;
+        }
+        $size = -1;
+        if ($f[0] eq "a" || $f[0] eq "r") {
+            $size = $f[2];
+            $n = 1;
+        } elsif ($f[0] eq "m") {
+            $size = $f[3];
+            $n = 1;
+        } elsif ($f[0] eq "A") {
+            $size = $f[2];
+            $n = $f[1];
+        }
+        next if $size <= 0;
+        # the block size malloc gives the request
+        $asize = int(($size + $wsize + $dsize - 1) / $dsize) * $dsize;
+        $asize = $dsize if $asize < $dsize;
+        $requests += $n;
+        $count{$asize} += $n if $asize <= $tree_min;
+    }
+    close(TRACE);
+    next if $requests == 0;
+    foreach $asize (keys %count) {
+        $hist[$asize / $dsize - 1] += $count{$asize} / $requests;
+    }
+}
+
+# The candidate upper bounds, as bucket indices (size / dsize - 1)
+@cand = ();
+for ($size = 2 * $dsize; $size <= 1024; $size += $dsize) {
+    push(@cand, $size / $dsize - 1);
+}
+for ($base = 1024; $base < $tree_min; $base *= 2) {
+    for ($i = 1; $i <= 8; $i++) {
+        $size = $base + $base * $i / 8;
+        push(@cand, $size / $dsize - 1);
+    }
+}
+
+# cost(lo, hi): the charge of a list holding buckets lo to hi
+sub cost
+{
+    my ($lo, $hi) = @_;
+    my ($b, $above, $above_bytes, $total, $sum);
+
+    $total = 0;
+    for ($b = $lo; $b <= $hi; $b++) {
+        $total += $hist[$b];
+    }
+    return 0 if $total == 0;
+
+    $above = 0;
+    $above_bytes = 0;
+    $sum = 0;
+    for ($b = $hi; $b >= $lo; $b--) {
+        next if $hist[$b] == 0;
+        my $size = ($b + 1) * $dsize;
+        $above += $hist[$b];
+        $above_bytes += $hist[$b] * $size;
+        my $probes = $total / $above;
+        $probes = $searchtime if $probes > $searchtime;
+        my $slack = ($above_bytes / $above - $size) / $size;
+        $sum += $hist[$b] * ($probes + $slack);
+    }
+    return $sum;
+}
+
+# best[k][j]: least charge for k lists covering 32 bytes up to cand[j]
+$nlists = $nclasses - 2;
+$ncand = @cand;
+for ($j = 0; $j < $ncand; $j++) {
+    $best[1][$j] = cost(1, $cand[$j]);
+    $from[1][$j] = -1;
+}
+for ($k = 2; $k <= $nlists; $k++) {
+    for ($j = $k - 1; $j < $ncand; $j++) {
+        $best[$k][$j] = -1;
+        for ($i = $k - 2; $i < $j; $i++) {
+            next if ($cand[$j] + 1) > $ratio * ($cand[$i] + 2);
+            next if $cand[$i] + 1 < $fast_max / $dsize &&
+                    $cand[$j] + 1 > $fast_max / $dsize;
+            $c = $best[$k - 1][$i] + cost($cand[$i] + 1, $cand[$j]);
+            if ($best[$k][$j] < 0 || $c < $best[$k][$j]) {
+                $best[$k][$j] = $c;
+                $from[$k][$j] = $i;
+            }
+        }
+    }
+}
+
+# Follow the choices back from the last list, which ends at tree_min
+@bound = ();
+$j = $ncand - 1;
+for ($k = $nlists; $k >= 1; $k--) {
+    unshift(@bound, ($cand[$j] + 1) * $dsize);
+    $j = $from[$k][$j];
+}
+unshift(@bound, $dsize);
+$tuned = $best[$nlists][$ncand - 1];
+
+# The charge of the power-of-two classes, for comparison
+@pow2 = (16, 32, 48, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768);
+$default = 0;
+for ($i = 1; $i < @pow2; $i++) {
+    $default += cost($pow2[$i - 1] / $dsize, $pow2[$i] / $dsize - 1);
+}
+
+if ($opt_v) {
+    printf STDERR "class  upper bound  weight\n";
+    for ($i = 0; $i < @bound; $i++) {
+        $lo = ($i == 0) ? 0 : $bound[$i - 1] / $dsize;
+        $w = 0;
+        for ($b = $lo; $b < $bound[$i] / $dsize; $b++) {
+            $w += $hist[$b];
+        }
+        printf STDERR "%5d  %11d  %6.3f\n", $i, $bound[$i], $w / @ARGV;
+    }
+    printf STDERR "cost %.4f per trace (power-of-two classes: %.4f)\n",
+        $tuned / @ARGV, $default / @ARGV;
+}
+
+# Write the header
+$out = STDOUT;
+if ($opt_o) {
+    open($out, ">", $opt_o) || die "Couldn't open output file '$opt_o'\n";
+}
+@names = map { s/.*\///r } @ARGV;
+$from_traces = join(" ", @names);
+$from_traces =~ s/(.{1,72})(?:\s+|$)/ *   $1\n/g;
+print $out "/*\n";
+print $out " * mm-classes.h - Free list size classes for mm.c\n";
+print $out " *\n";
+print $out " * Generated by mkclasses.pl from the request sizes of\n";
+print $out $from_traces;
+printf $out " * Expected cost %.4f per trace, against %.4f for power-of-two\n",
+    $tuned / @ARGV, $default / @ARGV;
+print $out " * classes. Regenerate with \"make classes\"; do not edit.\n";
+print $out " */\n\n";
+print $out "/** upper bound of each free list; larger blocks go in the tree */\n";
+print $out "static const size_t class_bound[] = {";
+for ($i = 0; $i < @bound; $i++) {
+    print $out ($i % 8 == 0) ? "\n    " : " ";
+    print $out "$bound[$i],";
+}
+print $out "\n};\n\n";
+print $out "/** free list of each size up to the last bound, by (size - 1) / 16 */\n";
+print $out "static const unsigned char class_index[] = {";
+$c = 0;
+for ($b = 0; $b < $nbuckets; $b++) {
+    $c++ while ($b + 1) * $dsize > $bound[$c];
+    print $out ($b % 16 == 0) ? "\n    " : " ";
+    print $out "$c,";
+}
+print $out "\n};\n";
+close($out) if $opt_o;
@@ -0,0 +1,155 @@
+/**
+ * @file mm-new.cc
+ * @brief Global operator new and delete for the interposition library
+ *
+ * Linked into mm.so with mm.c, so C++ programs allocate from it directly
+ * rather than through the C++ library's operator new calling malloc.
+ *
+ * - Plain and array new call malloc. On failure they call the new handler
+ *   and retry, or throw std::bad_alloc if there is none. The nothrow
+ *   versions return NULL instead.
+ * - Aligned new (for types with an alignment above that of malloc) calls
+ *   mm_memalign, which places the block at an aligned address without
+ *   padding it with the alignment.
+ * - Sized delete passes the size on to mm_free_sized, which puts a small
+ *   block in its cache bin without reading its header. Sized and unsized
+ *   delete work for aligned blocks too, since they are ordinary blocks.
+ */
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+extern "C" {
+void *mm_memalign(size_t alignment, size_t size);
+void mm_free_sized(void *ptr, size_t size);
+}
+
+namespace {
+
+/**
+ * allocate size bytes as operator new does
+ *
+ * param[in] size
+ * param[in] align the alignment, or 0 for that of malloc
+ * return the payload; throws std::bad_alloc if there is no memory and no
+ *        new handler
+ */
+void *new_block(std::size_t size, std::size_t align) {
+    if (size == 0) {
+        size = 1;
+    }
+    for (;;) {
+        void *bp = align == 0 ? malloc(size) : mm_memalign(align, size);
+        if (bp != NULL) {
+            return bp;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == NULL) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+/**
+ * allocate size bytes as nothrow operator new does
+ *
+ * param[in] size
+ * param[in] align the alignment, or 0 for that of malloc
+ * return the payload, or NULL
+ */
+void *new_block_nothrow(std::size_t size, std::size_t align) noexcept {
+    try {
+        return new_block(size, align);
+    } catch (...) {
+        return NULL;
+    }
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    return new_block(size, 0);
+}
+
+void *operator new[](std::size_t size) {
+    return new_block(size, 0);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return new_block_nothrow(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return new_block_nothrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t align) {
+    return new_block(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return new_block(size, static_cast<std::size_t>(align));
+}
+
+void *operator new(std::size_t size, std::align_val_t align,
+                   const std::nothrow_t &) noexcept {
+    return new_block_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align,
+                     const std::nothrow_t &) noexcept {
+    return new_block_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept {
+    mm_free_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept {
+    mm_free_sized(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t) noexcept {
+    mm_free_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size,
+                       std::align_val_t) noexcept {
+    mm_free_sized(ptr, size);
+}
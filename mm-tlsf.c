@@ -0,0 +1,1071 @@
+/**
+ * @file mm-tlsf.c
+ * @brief A 64-bit two-level segregated fit (TLSF) memory allocator
+ *
+ * 15-213: Introduction to Computer Systems
+ *
+ * This is an alternative allocation engine to mm.c. It is built as
+ * objs/mm-tlsf.o and linked into mdriver-tlsf (and mdriver-tlsf-emulate for
+ * the giant traces), so its throughput and utilization can be compared with
+ * the segregated-list policy of mm.c on the same traces.
+ *
+ * Overview of the allocator:
+- Free blocks are indexed by a two-level table. The first level splits sizes
+  into power-of-two ranges, the second splits each range into 16 equal
+  slices. Each level has a bitmap of non-empty lists, so malloc and free
+  touch a constant number of lists whatever the size of the heap.
+- A request is rounded up to the next slice boundary before the lookup, so
+  the head of any list found is large enough (good fit, no list walk).
+- Sizes below 256 bytes get 16 linear classes, 16 bytes apart.
+- The first level covers the full 64-bit size range, so the giant blocks of
+  sparse emulation are indexed like any other.
+- The control structure (bitmaps and list heads) lives at the start of the
+  heap rather than in globals, and is counted in the heap size.
+- Every block has a header; free blocks also have a footer and explicit
+  next/prev links. The header records whether the previous block is free,
+  so allocated blocks need no footer. The minimum block size is 32 bytes.
+ *
+ *************************************************************************
+ *
+ * @author Yuqiao Hu <yuqiaohu@andrew.cmu.edu>
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* Do not change the following! */
+
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#define memset mem_memset
+#define memcpy mem_memcpy
+#endif /* def DRIVER */
+
+/* You can change anything from here onward */
+
+/*
+ *****************************************************************************
+ * If DEBUG is defined (such as when running mdriver-dbg), these macros      *
+ * are enabled. You can use them to print debugging output and to check      *
+ * contracts only in debug mode.                                             *
+ *                                                                           *
+ * Only debugging macros with names beginning "dbg_" are allowed.            *
+ * You may not define any other macros having arguments.                     *
+ *****************************************************************************
+ */
+#ifdef DEBUG
+/* When DEBUG is defined, these form aliases to useful functions */
+#define dbg_printf(...) printf(__VA_ARGS__)
+#define dbg_requires(expr) assert(expr)
+#define dbg_assert(expr) assert(expr)
+#define dbg_ensures(expr) assert(expr)
+#else
+/* When DEBUG is not defined, no code gets generated for these */
+/* The sizeof() hack is used to avoid "unused variable" warnings */
+#define dbg_printf(...) (sizeof(__VA_ARGS__), -1)
+#define dbg_requires(expr) (sizeof(expr), 1)
+#define dbg_assert(expr) (sizeof(expr), 1)
+#define dbg_ensures(expr) (sizeof(expr), 1)
+#endif
+
+/* Basic constants */
+
+typedef uint64_t word_t;
+
+/** Word and header size (bytes) */
+static const size_t wsize = sizeof(word_t);
+
+/** Double word size (bytes) */
+static const size_t dsize = 2 * wsize;
+
+/** Minimum block size (bytes): header, next and prev links, footer */
+static const size_t min_block_size = 2 * dsize;
+
+/**
+ * the minimum amount the heap is extended by
+ * (Must be divisible by dsize)
+ */
+static const size_t chunksize = (1 << 12);
+
+/** largest request served; keeps the rounding in mapping_search in range */
+static const size_t max_request = ~(size_t)0 >> 1;
+
+/** to get the allocation status of the block itself */
+static const word_t alloc_mask = 0x1;
+
+/** to get whether the previous block in the heap is free */
+static const word_t prev_free_mask = 0x2;
+
+/** to AND with word to obtain the size of the block */
+static const word_t size_mask = ~(word_t)0xF;
+
+/** Shape of the two-level index */
+enum {
+    /** log2 of the number of second-level lists per first-level range */
+    sl_index_log2 = 4,
+    /** number of second-level lists per first-level range */
+    sl_index_count = 1 << sl_index_log2,
+    /** log2 of the alignment, which is also the step of the small classes */
+    align_log2 = 4,
+    /** sizes below 1 << fl_index_shift all map to first-level row 0 */
+    fl_index_shift = sl_index_log2 + align_log2,
+    /** bit length of the largest size that can be indexed */
+    fl_index_max = 63,
+    /** row 0 for small sizes plus one row per power of two above them */
+    fl_index_count = fl_index_max - fl_index_shift + 2
+};
+
+/** sizes below this are small and are classed linearly */
+static const size_t small_block_size = (size_t)1 << fl_index_shift;
+
+typedef struct block block_t;
+
+/** Represents the header and payload of one block in the heap */
+struct block {
+    /** Header contains size + prev free flag + allocation flag */
+    word_t header;
+
+    union {
+        struct {
+            block_t *next;
+            block_t *prev;
+        };
+        char payload[0];
+    };
+};
+
+/** The TLSF index: bitmaps and list heads, stored at the start of the heap */
+typedef struct {
+    /** bit i is set iff row i has a non-empty list */
+    word_t fl_bitmap;
+    /** bit j of entry i is set iff blocks[i][j] is non-empty */
+    uint32_t sl_bitmap[fl_index_count];
+    /** heads of the NULL-terminated free lists */
+    block_t *blocks[fl_index_count][sl_index_count];
+    /** number of times and total bytes the heap has grown by */
+    size_t grow_count;
+    size_t grow_bytes;
+    /** total size of the free blocks in each row, for mm_heapinfo */
+    size_t row_bytes[fl_index_count];
+    /** number of free blocks in the index */
+    size_t free_count;
+} control_t;
+
+/* Global variables */
+
+/** The TLSF index, at the lowest address of the heap */
+static control_t *control = NULL;
+
+/** Pointer to first block in the heap */
+static block_t *heap_start = NULL;
+
+/*
+ * ---------------------------------------------------------------------------
+ *                        BEGIN SHORT HELPER FUNCTIONS
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * Returns the maximum of two integers.
+ * param[in] x
+ * param[in] y
+ * return `x` if `x > y`, and `y` otherwise.
+ */
+static size_t max(size_t x, size_t y) {
+    return (x > y) ? x : y;
+}
+
+/**
+ * Rounds `size` up to next multiple of n
+ * param[in] size
+ * param[in] n
+ * return The size after rounding up
+ */
+static size_t round_up(size_t size, size_t n) {
+    return n * ((size + (n - 1)) / n);
+}
+
+/**
+ * Returns the index of the most significant set bit of a non-zero size.
+ * param[in] size
+ * return floor(log2(size))
+ */
+static int fls_size(size_t size) {
+    dbg_requires(size != 0);
+    return 63 - __builtin_clzl(size);
+}
+
+/**
+ * Packs the size and status bits of a block into a header or footer word.
+ *
+ * param[in] size The size of the block being represented
+ * param[in] prev_free True if the previous block in the heap is free
+ * param[in] alloc True if the block is allocated
+ * return The packed value
+ */
+static word_t pack(size_t size, bool prev_free, bool alloc) {
+    word_t word = size;
+    if (prev_free) {
+        word |= prev_free_mask;
+    }
+    if (alloc) {
+        word |= alloc_mask;
+    }
+    return word;
+}
+
+/**
+ * Extracts the size of a block from its header.
+ * param[in] block
+ * return The size of the block
+ */
+static size_t get_size(block_t *block) {
+    return (block->header & size_mask);
+}
+
+/**
+ * Returns the allocation status of a block, based on its header.
+ * param[in] block
+ * return True if the block is allocated
+ */
+static bool get_alloc(block_t *block) {
+    return (block->header & alloc_mask) != 0;
+}
+
+/**
+ * Returns whether the previous block in the heap is free.
+ * param[in] block
+ * return True if the previous block is free
+ */
+static bool get_prev_free(block_t *block) {
+    return (block->header & prev_free_mask) != 0;
+}
+
+/**
+ * Updates the prev free flag of a block, leaving the rest of its header.
+ * param[out] block
+ * param[in] prev_free
+ */
+static void set_prev_free(block_t *block, bool prev_free) {
+    if (prev_free) {
+        block->header |= prev_free_mask;
+    } else {
+        block->header &= ~prev_free_mask;
+    }
+}
+
+/**
+ * Given a payload pointer, returns a pointer to the corresponding block.
+ * param[in] bp A pointer to a block's payload
+ * return The corresponding block
+ */
+static block_t *payload_to_header(void *bp) {
+    return (block_t *)((char *)bp - offsetof(block_t, payload));
+}
+
+/**
+ * Given a block pointer, returns a pointer to the corresponding payload.
+ * param[in] block
+ * return A pointer to the block's payload
+ */
+static void *header_to_payload(block_t *block) {
+    dbg_requires(get_size(block) != 0);
+    return (void *)(block->payload);
+}
+
+/**
+ * Returns the payload size of an allocated block.
+ * param[in] block
+ * return The number of usable payload bytes
+ */
+static size_t get_payload_size(block_t *block) {
+    return get_size(block) - wsize;
+}
+
+/**
+ * Finds the next consecutive block on the heap.
+ * param[in] block A block in the heap, not the epilogue
+ * return The next consecutive block on the heap
+ */
+static block_t *find_next(block_t *block) {
+    dbg_requires(get_size(block) != 0);
+    return (block_t *)((char *)block + get_size(block));
+}
+
+/**
+ * Finds the previous consecutive block on the heap.
+ * param[in] block A block whose previous block is free
+ * return The previous block, located through its footer
+ */
+static block_t *find_prev(block_t *block) {
+    dbg_requires(get_prev_free(block));
+    word_t *footerp = &(block->header) - 1;
+    return (block_t *)((char *)block - (*footerp & size_mask));
+}
+
+/**
+ * Writes the header and footer of a free block.
+ * param[out] block
+ * param[in] size
+ * param[in] prev_free True if the previous block in the heap is free
+ */
+static void write_free_block(block_t *block, size_t size, bool prev_free) {
+    dbg_requires(size >= min_block_size);
+    block->header = pack(size, prev_free, false);
+    word_t *footerp = (word_t *)((char *)block + size - wsize);
+    *footerp = pack(size, false, false);
+}
+
+/**
+ * Computes the list a free block of `size` bytes is stored in.
+ *
+ * param[in] size
+ * param[out] fli First-level index
+ * param[out] sli Second-level index
+ */
+static void mapping_insert(size_t size, int *fli, int *sli) {
+    if (size < small_block_size) {
+        *fli = 0;
+        *sli = (int)(size >> align_log2);
+    } else {
+        int bits = fls_size(size);
+        *fli = bits - (fl_index_shift - 1);
+        *sli = (int)(size >> (bits - sl_index_log2)) ^ sl_index_count;
+    }
+}
+
+/**
+ * Computes the first list whose blocks are all at least `size` bytes.
+ *
+ * The size is rounded up to the next second-level boundary, so the head of
+ * that list (or of any later one) satisfies the request.
+ *
+ * param[in] size
+ * param[out] fli First-level index
+ * param[out] sli Second-level index
+ */
+static void mapping_search(size_t size, int *fli, int *sli) {
+    if (size >= small_block_size) {
+        size += ((size_t)1 << (fls_size(size) - sl_index_log2)) - 1;
+    }
+    mapping_insert(size, fli, sli);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                        END SHORT HELPER FUNCTIONS
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * Pushes a free block onto the front of its list.
+ *
+ * param[in] block A free block whose header and footer are written
+ */
+static void insert_free(block_t *block) {
+    int fl, sl;
+    mapping_insert(get_size(block), &fl, &sl);
+    control->row_bytes[fl] += get_size(block);
+    control->free_count++;
+
+    block_t *head = control->blocks[fl][sl];
+    block->next = head;
+    block->prev = NULL;
+    if (head != NULL) {
+        head->prev = block;
+    }
+    control->blocks[fl][sl] = block;
+    control->fl_bitmap |= (word_t)1 << fl;
+    control->sl_bitmap[fl] |= (uint32_t)1 << sl;
+}
+
+/**
+ * Unlinks a free block from its list.
+ *
+ * param[in] block A free block currently in the index
+ */
+static void remove_free(block_t *block) {
+    int fl, sl;
+    mapping_insert(get_size(block), &fl, &sl);
+    control->row_bytes[fl] -= get_size(block);
+    control->free_count--;
+
+    block_t *next = block->next;
+    block_t *prev = block->prev;
+    if (next != NULL) {
+        next->prev = prev;
+    }
+    if (prev != NULL) {
+        prev->next = next;
+    } else {
+        control->blocks[fl][sl] = next;
+        if (next == NULL) {
+            control->sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+            if (control->sl_bitmap[fl] == 0) {
+                control->fl_bitmap &= ~((word_t)1 << fl);
+            }
+        }
+    }
+}
+
+/**
+ * Finds a free block of at least asize bytes in constant time.
+ *
+ * The rounded-up list and every later one are found through the bitmaps.
+ * If all of them are empty, the head of the request's own list is tried as
+ * well, since it may still be large enough.
+ *
+ * param[in] asize
+ * return A free block still in the index, or NULL
+ */
+static block_t *find_fit(size_t asize) {
+    int fl, sl;
+    mapping_search(asize, &fl, &sl);
+
+    uint32_t sl_map = 0;
+    if (fl < fl_index_count) {
+        sl_map = control->sl_bitmap[fl] & (~(uint32_t)0 << sl);
+    }
+    if (sl_map == 0) {
+        word_t fl_map = 0;
+        if (fl + 1 < fl_index_count) {
+            fl_map = control->fl_bitmap & (~(word_t)0 << (fl + 1));
+        }
+        if (fl_map == 0) {
+            mapping_insert(asize, &fl, &sl);
+            block_t *block = control->blocks[fl][sl];
+            if (block != NULL && get_size(block) >= asize) {
+                return block;
+            }
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = control->sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return control->blocks[fl][sl];
+}
+
+/**
+ * Merges a free block with its free neighbours and indexes the result.
+ *
+ * param[in] block A free block with header and footer written, not in the
+ *                 index yet
+ * return The merged block
+ */
+static block_t *coalesce_block(block_t *block) {
+    size_t size = get_size(block);
+    block_t *next = find_next(block);
+
+    if (!get_alloc(next)) {
+        remove_free(next);
+        size += get_size(next);
+    }
+    if (get_prev_free(block)) {
+        block_t *prev = find_prev(block);
+        remove_free(prev);
+        size += get_size(prev);
+        block = prev;
+    }
+
+    write_free_block(block, size, false);
+    set_prev_free(find_next(block), true);
+    insert_free(block);
+    return block;
+}
+
+/**
+ * enlarge heap as blocks require more memory
+ *
+ * param[in] size
+ * return the free block holding the new memory (NULL if failed)
+ */
+static block_t *extend_heap(size_t size) {
+    void *bp;
+
+    size = round_up(size, dsize);
+    if ((bp = mem_sbrk((intptr_t)size)) == (void *)-1) {
+        return NULL;
+    }
+    control->grow_count++;
+    control->grow_bytes += size;
+
+    // The old epilogue becomes the header of the new block
+    block_t *block = payload_to_header(bp);
+    write_free_block(block, size, get_prev_free(block));
+
+    // Create new epilogue header
+    block_t *epilogue = find_next(block);
+    epilogue->header = pack(0, true, true);
+
+    return coalesce_block(block);
+}
+
+/**
+ * Splits an allocated block, returning the tail beyond asize to the index.
+ *
+ * param[in] block An allocated block
+ * param[in] asize The size the block keeps
+ */
+static void split_block(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block));
+
+    size_t size = get_size(block);
+    if (size - asize >= min_block_size) {
+        block->header = pack(asize, get_prev_free(block), true);
+        block_t *rest = find_next(block);
+        write_free_block(rest, size - asize, false);
+        coalesce_block(rest);
+    }
+}
+
+/**
+ * Adjusts a request to a block size: payload plus header, aligned.
+ * param[in] size
+ * return The block size
+ */
+static size_t adjust_size(size_t size) {
+    return max(round_up(size + wsize, dsize), min_block_size);
+}
+
+/**
+ * Checks the index: bitmaps match the lists, lists are well formed and
+ * each block is filed under its own size.
+ *
+ * param[in] line
+ * return the number of blocks in the index, or (size_t)-1 on error
+ */
+static size_t check_index(int line) {
+    size_t count = 0;
+
+    for (int fl = 0; fl < fl_index_count; fl++) {
+        bool fl_set = (control->fl_bitmap >> fl) & 1;
+        if (fl_set != (control->sl_bitmap[fl] != 0)) {
+            dbg_printf("line %d: first-level bitmap wrong for row %d.\n", line,
+                       fl);
+            return (size_t)-1;
+        }
+        for (int sl = 0; sl < sl_index_count; sl++) {
+            block_t *head = control->blocks[fl][sl];
+            bool sl_set = (control->sl_bitmap[fl] >> sl) & 1;
+            if (sl_set != (head != NULL)) {
+                dbg_printf("line %d: second-level bitmap wrong for list "
+                           "(%d, %d).\n",
+                           line, fl, sl);
+                return (size_t)-1;
+            }
+            block_t *prev = NULL;
+            for (block_t *block = head; block != NULL; block = block->next) {
+                int bfl, bsl;
+                mapping_insert(get_size(block), &bfl, &bsl);
+                if (bfl != fl || bsl != sl) {
+                    dbg_printf("line %d: free block in the wrong list.\n",
+                               line);
+                    return (size_t)-1;
+                }
+                if (get_alloc(block)) {
+                    dbg_printf("line %d: allocated block in a free list.\n",
+                               line);
+                    return (size_t)-1;
+                }
+                if (block->prev != prev) {
+                    dbg_printf("line %d: free list prev link broken.\n",
+                               line);
+                    return (size_t)-1;
+                }
+                prev = block;
+                count += 1;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * Checks the heap: boundary blocks, every block's header and footer, the
+ * prev free flags, coalescing, and that the index holds exactly the free
+ * blocks.
+ *
+ * param[in] line
+ * return true if the heap is consistent
+ */
+bool mm_checkheap(int line) {
+    if (control == NULL) {
+        return true;
+    }
+
+    char *low = mem_heap_lo();
+    char *high = mem_heap_hi();
+    if ((char *)control != low) {
+        dbg_printf("line %d: control structure is not at heap start.\n", line);
+        return false;
+    }
+
+    // prologue
+    word_t *prologue = &(heap_start->header) - 1;
+    if ((*prologue & size_mask) != 0 || (*prologue & alloc_mask) == 0) {
+        dbg_printf("line %d: bad prologue.\n", line);
+        return false;
+    }
+
+    block_t *block;
+    bool prev_free = false;
+    size_t count = 0;
+    for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
+        size_t size = get_size(block);
+        if ((char *)block + size > high - 7) {
+            dbg_printf("line %d: block exceeds upper limit of heap.\n", line);
+            return false;
+        }
+        if (size % dsize != 0 || size < min_block_size) {
+            dbg_printf("line %d: bad block size.\n", line);
+            return false;
+        }
+        if (((word_t)header_to_payload(block) % dsize) != 0) {
+            dbg_printf("line %d: payload not double-word aligned.\n", line);
+            return false;
+        }
+        if (get_prev_free(block) != prev_free) {
+            dbg_printf("line %d: prev free flag is wrong.\n", line);
+            return false;
+        }
+        if (!get_alloc(block)) {
+            word_t *footerp = (word_t *)((char *)block + size - wsize);
+            if ((*footerp & size_mask) != size) {
+                dbg_printf("line %d: header size != footer size.\n", line);
+                return false;
+            }
+            if (prev_free) {
+                dbg_printf("line %d: consecutive free blocks appear.\n", line);
+                return false;
+            }
+            count += 1;
+        }
+        prev_free = !get_alloc(block);
+    }
+
+    // epilogue
+    if ((char *)block != high - 7 || !get_alloc(block)) {
+        dbg_printf("line %d: bad epilogue.\n", line);
+        return false;
+    }
+    if (get_prev_free(block) != prev_free) {
+        dbg_printf("line %d: epilogue prev free flag is wrong.\n", line);
+        return false;
+    }
+
+    size_t count_free = check_index(line);
+    if (count_free == (size_t)-1) {
+        return false;
+    }
+    if (count != count_free) {
+        dbg_printf("line %d: the number of free blocks doesn't match.\n",
+                   line);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Checks the heap as mm_checkheap does. This allocator has no parallel
+ * walk, so the threads are not used.
+ *
+ * param[in] line
+ * param[in] threads
+ * return true if the heap is consistent
+ */
+bool mm_checkheap_parallel(int line, int threads) {
+    return mm_checkheap(line);
+}
+
+/**
+ * initialize the heap: the TLSF index, then prologue & epilogue
+ *
+ * return true if succeed and false otherwise
+ */
+bool mm_init(void) {
+    size_t control_size = round_up(sizeof(control_t), dsize);
+    char *start = mem_sbrk((intptr_t)(control_size + dsize));
+
+    if (start == (void *)-1) {
+        return false;
+    }
+
+    control = (control_t *)start;
+    control->fl_bitmap = 0;
+    for (int fl = 0; fl < fl_index_count; fl++) {
+        control->sl_bitmap[fl] = 0;
+        control->row_bytes[fl] = 0;
+        for (int sl = 0; sl < sl_index_count; sl++) {
+            control->blocks[fl][sl] = NULL;
+        }
+    }
+    control->grow_count = 0;
+    control->grow_bytes = 0;
+    control->free_count = 0;
+
+    word_t *words = (word_t *)(start + control_size);
+    words[0] = pack(0, false, true); // Heap prologue (block footer)
+    words[1] = pack(0, false, true); // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    heap_start = (block_t *)&(words[1]);
+
+    if (extend_heap(chunksize) == NULL) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * report the heap growth policy, which is always a fixed chunksize here
+ *
+ * param[out] stats
+ */
+void mm_growth(mm_growth_t *stats) {
+    if (control == NULL) {
+        mm_init();
+    }
+    stats->adaptive = false;
+    stats->step = chunksize;
+    stats->count = control->grow_count;
+    stats->bytes = control->grow_bytes;
+    stats->trims = 0;
+}
+
+/**
+ * report the hot-path counters, which this allocator doesn't keep
+ *
+ * param[out] stats
+ */
+void mm_stats(mm_stats_t *stats) {
+    stats->enabled = false;
+    stats->fits = 0;
+    stats->lists = 0;
+    stats->nodes = 0;
+    stats->capped = 0;
+    stats->splits = 0;
+    for (int i = 0; i < 4; i++) {
+        stats->coalesce[i] = 0;
+    }
+    stats->extends = 0;
+    stats->extend_bytes = 0;
+}
+
+/**
+ * report the free space in the heap
+ *
+ * The classes are the first-level rows, with every row from the last
+ * class up folded into it. The largest block is in the highest non-empty
+ * list, which is the only one scanned.
+ *
+ * param[out] info
+ */
+void mm_heapinfo(mm_heapinfo_t *info) {
+    if (control == NULL) {
+        mm_init();
+    }
+    info->free_bytes = 0;
+    for (int i = 0; i < mm_class_count; i++) {
+        info->class_min[i] = (i == 0) ? min_block_size
+                                      : small_block_size << (i - 1);
+        info->class_bytes[i] = 0;
+    }
+    for (int fl = 0; fl < fl_index_count; fl++) {
+        int i = (fl < mm_class_count) ? fl : mm_class_count - 1;
+        info->class_bytes[i] += control->row_bytes[fl];
+        info->free_bytes += control->row_bytes[fl];
+    }
+    info->free_blocks = control->free_count;
+
+    info->largest = 0;
+    if (control->fl_bitmap != 0) {
+        int fl = 63 - __builtin_clzl(control->fl_bitmap);
+        int sl = 31 - __builtin_clz(control->sl_bitmap[fl]);
+        for (block_t *block = control->blocks[fl][sl]; block != NULL;
+             block = block->next) {
+            info->largest = max(info->largest, get_size(block));
+        }
+    }
+    info->top = 0;
+    info->cached_bytes = 0;
+    info->frag = 0;
+    if (info->free_bytes > 0) {
+        info->frag =
+            1.0 - (double)info->largest / (double)info->free_bytes;
+    }
+}
+
+/**
+ * allocate a block with size in heap
+ *
+ * param[in] size
+ * return the payload of the allocated block, or NULL
+ */
+void *malloc(size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (control == NULL) {
+        mm_init();
+    }
+
+    if (size == 0 || size > max_request) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return NULL;
+    }
+
+    size_t asize = adjust_size(size);
+    block_t *block = find_fit(asize);
+
+    if (block == NULL) {
+        block = extend_heap(max(asize, chunksize));
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    dbg_assert(!get_alloc(block) && get_size(block) >= asize);
+
+    // Mark block as allocated, then give back what it doesn't need
+    remove_free(block);
+    block->header = pack(get_size(block), get_prev_free(block), true);
+    set_prev_free(find_next(block), false);
+    split_block(block, asize);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return header_to_payload(block);
+}
+
+/**
+ * free the block and coalesce it with its neighbours
+ *
+ * param[in] bp
+ */
+void free(void *bp) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (bp == NULL) {
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+    dbg_assert(get_alloc(block));
+
+    write_free_block(block, get_size(block), get_prev_free(block));
+    coalesce_block(block);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * reallocate a block to targeted size
+ *
+ * Shrinking gives the tail back; growing first tries to absorb a free
+ * next block, and only then falls back to malloc, copy and free.
+ *
+ * param[in] ptr
+ * param[in] size
+ * return new reallocated block (void*)
+ */
+void *realloc(void *ptr, size_t size) {
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+
+    if (size > max_request) {
+        return NULL;
+    }
+
+    block_t *block = payload_to_header(ptr);
+    size_t asize = adjust_size(size);
+    size_t block_size = get_size(block);
+
+    if (asize <= block_size) {
+        split_block(block, asize);
+        return ptr;
+    }
+
+    block_t *next = find_next(block);
+    if (!get_alloc(next) && block_size + get_size(next) >= asize) {
+        remove_free(next);
+        block->header =
+            pack(block_size + get_size(next), get_prev_free(block), true);
+        set_prev_free(find_next(block), false);
+        split_block(block, asize);
+        return ptr;
+    }
+
+    void *newptr = malloc(size);
+
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL) {
+        return NULL;
+    }
+
+    memcpy(newptr, ptr, get_payload_size(block));
+    free(ptr);
+
+    return newptr;
+}
+
+/**
+ * allocate block with all elements initialized to 0
+ *
+ * param[in] elements
+ * param[in] size
+ * return the allocated & intialized block or NULL
+ */
+void *calloc(size_t elements, size_t size) {
+    void *bp;
+    size_t asize = elements * size;
+
+    if (elements == 0) {
+        return NULL;
+    }
+    if (asize / elements != size) {
+        // Multiplication overflowed
+        return NULL;
+    }
+
+    bp = malloc(asize);
+    if (bp == NULL) {
+        return NULL;
+    }
+
+    // Initialize all bits to 0
+    memset(bp, 0, asize);
+
+    return bp;
+}
+
+/**
+ * allocate n blocks of the same size, one at a time
+ *
+ * param[in] size
+ * param[in] n
+ * param[out] ptrs
+ * return the number of blocks allocated
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t done = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    for (; done < n; done++) {
+        ptrs[done] = malloc(size);
+        if (ptrs[done] == NULL) {
+            break;
+        }
+    }
+    return done;
+}
+
+/**
+ * free n blocks, one at a time
+ *
+ * param[in] n
+ * param[in] ptrs
+ */
+void mm_free_batch(size_t n, void **ptrs) {
+    for (size_t i = 0; i < n; i++) {
+        free(ptrs[i]);
+    }
+}
+
+/**
+ * allocate an aligned block
+ *
+ * A block with room for the alignment is allocated, and the bytes in front
+ * of the aligned address are freed again, as are those after the block.
+ *
+ * param[in] alignment a power of two
+ * param[in] size
+ * return the aligned payload, or NULL
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= dsize) {
+        return malloc(size);
+    }
+    if (size == 0 || size > max_request - alignment - min_block_size) {
+        return NULL;
+    }
+
+    void *bp = malloc(size + alignment + min_block_size);
+    if (bp == NULL) {
+        return NULL;
+    }
+
+    // The leading fragment must be big enough to be a block of its own
+    block_t *block = payload_to_header(bp);
+    size_t lead = round_up((size_t)bp, alignment) - (size_t)bp;
+    if (lead != 0 && lead < min_block_size) {
+        lead += alignment;
+    }
+    if (lead != 0) {
+        block_t *aligned = (block_t *)((char *)block + lead);
+        aligned->header = pack(get_size(block) - lead, true, true);
+        write_free_block(block, lead, get_prev_free(block));
+        coalesce_block(block);
+        block = aligned;
+    }
+
+    split_block(block, adjust_size(size));
+    return header_to_payload(block);
+}
+
+/**
+ * report the usable size of an allocated block
+ *
+ * param[in] ptr
+ * return the payload size, or 0 for NULL
+ */
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    return get_payload_size(payload_to_header(ptr));
+}
+
+/**
+ * report the smallest usable size that a request of size bytes gets
+ *
+ * A block is only split if the rest makes a block of min_block_size, so
+ * the usable size can be up to that much more.
+ *
+ * param[in] size
+ * return the usable size of a block of the adjusted size
+ */
+size_t mm_good_size(size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    if (size > max_request) {
+        return size;
+    }
+    return adjust_size(size) - wsize;
+}
@@ -12,9 +12,84 @@
   free block.
 - free list: a block_t* array storing different size of free blocks in different
   elements (segment lists). A total of 14 segment lists.
+- The bounds of the lists between 16 and 32768 bytes are not powers of two
+  but come from mm-classes.h, which mkclasses.pl derives from the request
+  sizes of a set of traces to keep list scans and slack low.
 - Only free blocks that aren't minimum size block have footers, all other blocks
   only have headers.
 - The free blocks are added to the free list according to their size.
+- Free mini blocks have no room for a prev pointer, so their header stores it
+  in the size bits (flagged by bit 3; a mini block's size is always 16). The
+  class-0 list is therefore doubly linked like the others and unlinks in O(1).
+- A bitmap records which segment lists are non-empty, so class selection in
+  find_fit is a count-trailing-zeros instead of probing empty lists.
+- Free blocks above 32768 bytes are kept in an AVL tree ordered by size and
+  then address instead of a list, so the largest class is searched for the
+  true best fit in O(log n) rather than with a capped scan.
+- A small state record sits before the prologue. It holds a zero frontier:
+  above it the heap still has the zeros of fresh memory from memlib, so
+  calloc only clears what lies below it.
+- Freed blocks of up to 128 bytes go into per-size LIFO fast bins without
+  touching any boundary tags, and malloc of the same size pops them back.
+  The bins are consolidated (freed for real and coalesced) when a request
+  misses the free lists or when they hold more than 64 KiB.
+- When the last block in the heap is free and at least 128 KiB, the heap is
+  shrunk with a negative mem_sbrk, leaving a chunksize free block.
+- When no free block fits, the heap grows by a step that doubles with each
+  growth, capped at 1/64 of the heap so the unused tail stays small, and
+  that falls back to chunksize on every free, so only back-to-back
+  growths double it. Growth counts are kept in the state record and
+  reported by mm_growth.
+- insert_free and clear_free keep the bytes in each free list and the
+  number of free blocks next to the list heads, so mm_heapinfo reports
+  the free space and its fragmentation without walking the heap.
+- Built with MM_STATS, the state record counts fit searches, the
+  lists and blocks they look at, splits, each coalesce case and heap
+  extensions, for mm_stats to report. Without it the counting compiles
+  away.
+- In debug builds, every call that writes a block's tags or a free list's
+  links logs the block, and the checks around each malloc and free look
+  only at the logged blocks and their neighbours. A full mm_checkheap runs
+  every MM_CHECK_FULL checks, or when the log overflows.
+- mm_checkheap_parallel checks a large heap on several threads. Each walks
+  the stretch between two listed free blocks and checks that the free
+  blocks it meets are marked in a bitmap built from the free lists.
+- Free list links are 32-bit offsets from heap_start, counted in dsize
+  units, as long as the heap is under 64 GiB. A larger heap (the sparse
+  giant traces) switches every list to full pointers once, for good.
+- Requests of at least map_threshold bytes get a region of their own from
+  mem_map instead of heap space, and free gives it straight back with
+  mem_unmap. The block header sits one word into the region and has bit 3
+  set along with the alloc bit.
+- mm.so runs several arenas, each a separate memlib heap with its own
+  lock, state record and lists. Threads are spread over them round robin,
+  and free finds the arena that owns a block from its address alone, with
+  mem_heap_id. The lists live in the state record for this reason; the
+  driver build, with one heap, keeps them in a global outside it.
+- A thread freeing a block of another arena doesn't take that arena's lock:
+  it pushes the block onto the arena's lock-free remote list, which is
+  freed in one batch the next time the arena is locked.
+- Small blocks freed in mm.so are cached per CPU, and malloc takes them
+  back with restartable sequences (rseq), so neither needs a lock or an
+  atomic instruction and the memory held is bounded by the CPU count.
+  Without rseq, each thread has a cache of its own instead.
+- mm_free_sized, used by sized operator delete in mm.so, knows the block
+  size from the request and pushes a small block onto its cache bin
+  without reading the header.
+- mm_malloc_batch adjusts the size once and cuts as many blocks as fit
+  from each free block it finds, so the free block leaves its list once.
+  mm_free_batch frees runs of neighbouring blocks as one block.
+- mm_usable_size reports the whole payload of a block, and mm_good_size
+  the payload a request would get, so callers can grow into the slack.
+- mm_memalign (and memalign, posix_memalign and aligned_alloc in mm.so)
+  finds a free block with room for an aligned payload and splits off the
+  part before it as a free block of its own, rather than allocating size
+  plus alignment and wasting the slack.
+- The free block that ends the heap is the top chunk. It is kept in the
+  state record rather than in a list, tried only once no list fits, and
+  carved from its low end, so a growing heap allocates by bumping the top
+  up with no list work. extend_heap merges the new space into it. A free
+  mini block at the end stays in class 0.
 - The fit function is a mix one (better fit)
  *
  *************************************************************************
@@ -31,16 +106,20 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "mm-classes.h"
 
 /* Do not change the following! */
 
@@ -56,6 +135,22 @@
 
 /* You can change anything from here onward */
 
+#ifndef DRIVER
+/*
+ * The interposition library (mm.so) is thread safe: the allocator below is
+ * compiled under these names, and the malloc, free, realloc, calloc,
+ * batch and aligned functions at the end of the file wrap it with caches
+ * and arena locks.
+ */
+#define malloc heap_malloc
+#define free heap_free
+#define realloc heap_realloc
+#define calloc heap_calloc
+#define mm_malloc_batch heap_malloc_batch
+#define mm_free_batch heap_free_batch
+#define mm_memalign heap_memalign
+#endif /* ndef DRIVER */
+
 /*
  *****************************************************************************
  * If DEBUG is defined (such as when running mdriver-dbg), these macros      *
@@ -104,6 +199,74 @@ static const size_t chunksize = (1 << 12);
 
 static const size_t searchtime = 0x10;
 
+/**
+ * a free block at the end of the heap at least this big is trimmed, down
+ * to chunksize bytes, by shrinking the heap
+ */
+static const size_t trim_threshold = (1 << 17);
+
+/** largest block size kept in a fast bin */
+static const size_t fast_max = 0x80;
+
+/** fast bins are consolidated once they hold more than this many bytes */
+static const size_t fast_limit = (1 << 16);
+
+/** number of fast bins: one per block size from 16 to fast_max */
+enum { fast_count = 8 };
+
+/**
+ * whether the heap growth step adapts to demand; if false the heap always
+ * grows by chunksize (or the request, if larger)
+ */
+static const bool grow_adaptive = true;
+
+/** the adaptive growth step is at most the heap size shifted right by this */
+static const size_t grow_cap_shift = 6;
+
+/** requests at least this big are served from their own mem_map region */
+static const size_t map_threshold = (1 << 20);
+
+/*
+ * Build with -DMM_STATS=1 (mdriver-stats) to count what the hot paths do;
+ * otherwise the counters and every update to them compile away.
+ */
+#ifndef MM_STATS
+#define MM_STATS 0
+#endif
+
+/*
+ * In debug builds the heap checks on entry to and exit from each call look
+ * only at the blocks touched since the last check. Every MM_CHECK_FULL-th
+ * check walks the whole heap instead; build with -DMM_CHECK_FULL=1 to walk
+ * it every time.
+ */
+#ifndef MM_CHECK_FULL
+#define MM_CHECK_FULL 1000
+#endif
+
+/** number of touched blocks logged for the next incremental check */
+enum { dirty_max = 64 };
+
+/** mm_checkheap_parallel gives each thread at least this much of the heap */
+static const size_t check_segment_min = (1 << 20);
+
+/** most threads mm_checkheap_parallel uses */
+enum { check_threads_max = 64 };
+
+/** the hot-path counters kept with MM_STATS; see mm_stats */
+typedef enum {
+    stat_fits,   // find_fit calls
+    stat_lists,  // free lists probed by find_fit
+    stat_nodes,  // blocks visited by find_fit_basic
+    stat_capped, // find_fit_basic scans stopped by searchtime
+    stat_splits, // blocks split by split_block
+    // coalesce_block calls, one counter for each of its four cases
+    stat_coalesce,
+    stat_extends = stat_coalesce + 4, // extend_heap calls
+    stat_extend_bytes,                // bytes asked of extend_heap
+    stat_count
+} stat_t;
+
 /**
  * to AND with the word to obtain the allocation status
  * change from 0x1 to 0x7 to include 3 allocation status bits
@@ -122,37 +285,27 @@ static const word_t alloc_mask_curr = 0x1;
  */
 static const word_t min_mask = 0x4;
 
+/**
+ * set in the header of a free mini block, whose size bits then hold the
+ * payload address of its prev block in the free list instead of its size
+ */
+static const word_t mini_free_mask = 0x8;
+
+/**
+ * the same bit, set in the header of an allocated block, marks a block that
+ * fills a region of its own from mem_map
+ */
+static const word_t mapped_mask = 0x8;
+
 /**
  * to AND with word to obtain the size of the block
  */
 static const word_t size_mask = ~(word_t)0xF;
 
+/** a list block this much larger than a request is taken at once */
 static const size_t free_16 = 0x10;
 
-static const size_t free_32 = 0x20;
-
-static const size_t free_48 = 0x30;
-
-static const size_t free_64 = 0x40;
-
-static const size_t free_128 = 0x80;
-
-static const size_t free_256 = 0x100;
-
-static const size_t free_512 = 0x200;
-
-static const size_t free_1024 = 0x400;
-
-static const size_t free_2048 = 0x800;
-
-static const size_t free_4096 = 0x1000;
-
-static const size_t free_8192 = 0x2000;
-
-static const size_t free_16384 = 0x4000;
-
-static const size_t free_32768 = 0x8000;
-
+/** number of free lists; their size classes come from mm-classes.h */
 static const size_t free_size = 0x0E;
 
 typedef struct block block_t;
@@ -167,32 +320,114 @@ struct block {
             block_t *next;
             block_t *prev;
         };
+        /* free list links while they are narrow; see get_next_link */
+        struct {
+            uint32_t next_link;
+            uint32_t prev_link;
+        };
+        /* free blocks of the largest class are nodes of a balanced tree */
+        struct {
+            block_t *left;
+            block_t *right;
+            size_t height;
+        };
         char payload[0];
     };
 };
 
-/* Global variables */
+/**
+ * The heads of the free lists, and the totals mm_heapinfo reports. The
+ * driver build keeps them in a global, outside the heap, where they don't
+ * count against utilization; mm.so needs one copy per arena and keeps
+ * them in the state record.
+ */
+typedef struct {
+    /**
+     * the heads of the segregated free lists
+     *  index 0: 16 byte (mini) free list
+     *  index i, 1 to 12: free list of sizes up to class_bound[i] bytes,
+     *            above those of list i - 1
+     *  index 13: 32768-inf byte free blocks, as the root of an AVL tree
+     *            ordered by size, then address
+     */
+    block_t *free_list_start[free_size];
+    /** bit i is set iff free_list_start[i] is non-empty */
+    word_t free_list_bitmap;
+    /** total size of the blocks in each free list, for mm_heapinfo */
+    size_t free_list_bytes[free_size];
+    /** number of blocks in all the free lists */
+    size_t free_count;
+} free_lists_t;
 
-/** an arrary storing all free list starter pointers
- *  index 0: 0-16 byte free list
- *  index 1: 16-32 byte free list
- *  index 2: 32-48 byte free list
- *  index 3: 48-64 byte free list
- *  index 4: 64-128 byte free list
- *  index 5: 128-256 byte free list
- *  index 6: 256-512 byte free list
- *  index 7: 512-1024 byte free list
- *  index 8: 1024-2048 byte free list
- *  index 9: 2048-4096 byte free list
- *  index 10: 4096-8192 byte free list
- *  index 11: 8192-16384 byte free list
- *  index 12: 16384-32768 byte free list
- *  index 13: 32768-inf byte free list
- */
-static block_t *free_list_start[free_size];
+/**
+ * Allocator state kept at the start of the heap instead of in globals.
+ * It is dsize aligned, so its size is a multiple of dsize and the blocks
+ * after it stay aligned.
+ */
+typedef struct __attribute__((aligned(16))) {
+#ifndef DRIVER
+    /** the free lists of the arena */
+    free_lists_t lists;
+#endif
+    /**
+     * the top chunk: the free block that ends the heap, kept out of the
+     * free lists so it is carved only when no list fits; NULL when the
+     * last block is allocated or a free mini block
+     */
+    block_t *top;
+    /**
+     * every heap byte in [zero_frontier, brk - dsize) is still zero; blocks
+     * handed out push it up to four words past their end, which covers the
+     * header and links written for the block that follows
+     */
+    char *zero_frontier;
+    /** total size of the blocks sitting in the fast bins */
+    size_t fast_bytes;
+    /**
+     * LIFO lists of freed small blocks, bin i holding size (i + 1) * 16.
+     * The blocks keep their allocated header, so nothing coalesces with
+     * them until they are consolidated.
+     */
+    block_t *fast_bins[fast_count];
+    /** how much the heap grows by when no free block fits; see grow_size */
+    size_t grow_step;
+    /** number of times and total bytes the heap has grown by */
+    size_t grow_count;
+    size_t grow_bytes;
+    /** number of times the heap has been trimmed */
+    size_t trim_count;
+    /**
+     * free list links are narrow while the heap ends below this address,
+     * the farthest a 32-bit link can reach; NULL once links are full
+     * pointers
+     */
+    char *link_limit;
+#if MM_STATS
+    /** hot-path counters since mm_init, indexed by stat_t */
+    size_t stats[stat_count];
+#endif
+#ifdef DEBUG
+    /** blocks whose tags or links changed since the last heap check */
+    block_t *dirty[dirty_max];
+    /** entries in dirty; more than dirty_max once it has overflowed */
+    size_t dirty_count;
+    /** heap checks since the last full one */
+    size_t checks;
+#endif
+} heap_state_t;
+
+/* Global variables */
 
+#ifdef DRIVER
 /** Pointer to first block in the heap */
 static block_t *heap_start = NULL;
+/** The free lists */
+static free_lists_t free_lists;
+#else
+/** Pointer to first block in the heap of the arena the thread has locked */
+static __thread block_t *heap_start
+    __attribute__((tls_model("initial-exec")));
+#endif /* def DRIVER */
 
 /*
  *****************************************************************************
@@ -224,6 +459,16 @@ static size_t max(size_t x, size_t y) {
     return (x > y) ? x : y;
 }
 
+/**
+ * Returns the minimum of two integers.
+ * param[in] x
+ * param[in] y
+ * return `x` if `x < y`, and `y` otherwise.
+ */
+static size_t min(size_t x, size_t y) {
+    return (x < y) ? x : y;
+}
+
 /**
  * Rounds `size` up to next multiple of n
  * param[in] size
@@ -262,12 +507,16 @@ static word_t pack(size_t size, bool alloc_prev, bool alloc_curr,
  * Extracts the size represented in a packed word.
  *
  * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
+ * is 16-byte aligned. A free mini block header carries a link in its size
+ * bits instead, and always has size min_block_size.
  *
  * param[in] word
  * return The size of the block represented by the word
  */
 static size_t extract_size(word_t word) {
+    if ((word & (mini_free_mask | alloc_mask_curr)) == mini_free_mask) {
+        return min_block_size;
+    }
     return (word & size_mask);
 }
 
@@ -387,6 +636,9 @@ static bool get_prev_alloc(block_t *block) {
  */
 static size_t get_payload_size(block_t *block) {
     size_t asize = get_size(block);
+    if ((block->header & mapped_mask) != 0 && get_alloc(block, false)) {
+        return asize - dsize;
+    }
     if (asize == min_block_size) {
         return wsize;
     }
@@ -409,42 +661,383 @@ static void write_epilogue(block_t *block, bool prev) {
     block->header = pack(0, prev, true, false);
 }
 
+/**
+ * Finds the allocator state record, which ends just before the prologue.
+ * return The state record
+ */
+static heap_state_t *get_state(void) {
+    return (heap_state_t *)((char *)heap_start - wsize -
+                            sizeof(heap_state_t));
+}
+
+/**
+ * Finds the free lists of the heap.
+ * return The free lists
+ */
+static free_lists_t *get_lists(void) {
+#ifdef DRIVER
+    return &free_lists;
+#else
+    return &get_state()->lists;
+#endif
+}
+
+/**
+ * Adds to a hot-path counter; does nothing unless built with MM_STATS.
+ *
+ * param[in] stat The counter
+ * param[in] n The amount to add
+ */
+static void count_stat(stat_t stat, size_t n) {
+#if MM_STATS
+    get_state()->stats[stat] += n;
+#endif
+}
+
+/**
+ * Reads a hot-path counter.
+ *
+ * param[in] stat The counter
+ * return Its value, always 0 unless built with MM_STATS
+ */
+static size_t get_stat(stat_t stat) {
+#if MM_STATS
+    return get_state()->stats[stat];
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Moves the zero frontier past a block being handed out.
+ *
+ * The payload may be written from now on, and the header and links of the
+ * block after it lie within four words of its end.
+ *
+ * param[in] block A block that has just been allocated or resized
+ */
+static void touch_block(block_t *block) {
+    heap_state_t *state = get_state();
+    char *end = (char *)block + get_size(block) + 4 * wsize;
+    if (end > state->zero_frontier) {
+        state->zero_frontier = end;
+    }
+}
+
+/**
+ * Logs a block whose header, footer or links have just been written, for
+ * the next incremental heap check; does nothing unless built with DEBUG.
+ *
+ * A block swallowed by a lower one afterwards stays in the log, which is
+ * fine: the lower block's header is written as well, so it is logged too.
+ *
+ * param[in] block
+ */
+static void mark_dirty(block_t *block) {
+#ifdef DEBUG
+    heap_state_t *state = get_state();
+    if (state->dirty_count < dirty_max) {
+        state->dirty[state->dirty_count] = block;
+    }
+    state->dirty_count++;
+#endif
+}
+
 /**
  * get the free list a particular size belongs to
  *
+ * The class of a list size is looked up in class_index, one entry per
+ * dsize step, rather than by comparing against every boundary.
  *
  * param[in] size The size of a free block
  * return the free list start pointer that the block size should stay
  */
 int get_free_list(size_t size) {
-    if (size <= free_16) {
-        return 0;
-    } else if (size <= free_32) {
-        return 1;
-    } else if (size <= free_48) {
-        return 2;
-    } else if (size <= free_64) {
-        return 3;
-    } else if (size <= free_128) {
-        return 4;
-    } else if (size <= free_256) {
-        return 5;
-    } else if (size <= free_512) {
-        return 6;
-    } else if (size <= free_1024) {
-        return 7;
-    } else if (size <= free_2048) {
-        return 8;
-    } else if (size <= free_4096) {
-        return 9;
-    } else if (size <= free_8192) {
-        return 10;
-    } else if (size <= free_16384) {
-        return 11;
-    } else if (size <= free_32768) {
-        return 12;
+    if (size > class_bound[free_size - 2]) {
+        return (int)free_size - 1;
+    }
+    return class_index[(size - 1) / dsize];
+}
+
+/**
+ * get the smallest block size a free list holds, the inverse of
+ * get_free_list
+ *
+ * param[in] i The index of a free list
+ * return The smallest size that get_free_list maps to i
+ */
+static size_t get_class_min(int i) {
+    if (i == 0) {
+        return min_block_size;
+    }
+    return class_bound[i - 1] + dsize;
+}
+
+/**
+ * Finds the prev block of a free mini block in its free list.
+ *
+ * param[in] block A free mini block
+ * return The prev free mini block, read back from the header's size bits
+ */
+static block_t *get_mini_prev(block_t *block) {
+    dbg_requires((block->header & mini_free_mask) != 0);
+    return payload_to_header((void *)(block->header & size_mask));
+}
+
+/**
+ * Stores the prev link of a free mini block in its header.
+ *
+ * The prev block's payload address is 16-byte aligned, so it fits in the
+ * size bits; the status bits of the header are kept.
+ *
+ * param[out] block A free mini block
+ * param[in] prev The prev free mini block in the list
+ */
+static void set_mini_prev(block_t *block, block_t *prev) {
+    block->header = (block->header & alloc_mask) | mini_free_mask |
+                    (word_t)prev->payload;
+}
+
+/**
+ * Reads the next link of a block in a free list.
+ *
+ * A narrow link is the distance from heap_start in dsize units, which
+ * reaches any block while the heap is below link_limit.
+ *
+ * param[in] block A block in a free list
+ * return The next block in the list
+ */
+static block_t *get_next_link(block_t *block) {
+    if (get_state()->link_limit == NULL) {
+        return block->next;
+    }
+    return (block_t *)((char *)heap_start + (size_t)block->next_link * dsize);
+}
+
+/**
+ * Reads the prev link of a block in a free list (not a mini block).
+ * param[in] block A block in a free list
+ * return The prev block in the list
+ */
+static block_t *get_prev_link(block_t *block) {
+    if (get_state()->link_limit == NULL) {
+        return block->prev;
+    }
+    return (block_t *)((char *)heap_start + (size_t)block->prev_link * dsize);
+}
+
+/**
+ * Writes the next link of a block in a free list.
+ * param[out] block A block in a free list
+ * param[in] next The next block in the list
+ */
+static void set_next_link(block_t *block, block_t *next) {
+    if (get_state()->link_limit == NULL) {
+        block->next = next;
+    } else {
+        block->next_link =
+            (uint32_t)(((char *)next - (char *)heap_start) / dsize);
+    }
+}
+
+/**
+ * Writes the prev link of a block in a free list (not a mini block).
+ * param[out] block A block in a free list
+ * param[in] prev The prev block in the list
+ */
+static void set_prev_link(block_t *block, block_t *prev) {
+    if (get_state()->link_limit == NULL) {
+        block->prev = prev;
+    } else {
+        block->prev_link =
+            (uint32_t)(((char *)prev - (char *)heap_start) / dsize);
+    }
+}
+
+/**
+ * Returns the height of a subtree of the large-block tree.
+ * param[in] node The root of the subtree, or NULL
+ * return The height, 0 for an empty subtree
+ */
+static size_t tree_height(block_t *node) {
+    return (node == NULL) ? 0 : node->height;
+}
+
+/**
+ * Orders two large free blocks by size, breaking ties by address.
+ * param[in] a
+ * param[in] b
+ * return true if `a` comes before `b` in the tree
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t size_a = get_size(a);
+    size_t size_b = get_size(b);
+    return size_a < size_b || (size_a == size_b && a < b);
+}
+
+/**
+ * Recomputes the height of a tree node from its children.
+ * param[out] node
+ */
+static void tree_update(block_t *node) {
+    node->height = 1 + max(tree_height(node->left), tree_height(node->right));
+}
+
+/**
+ * Rotates a subtree right, lifting its left child.
+ * param[in] node The root of the subtree
+ * return The new root of the subtree
+ */
+static block_t *tree_rotate_right(block_t *node) {
+    block_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    tree_update(node);
+    tree_update(left);
+    return left;
+}
+
+/**
+ * Rotates a subtree left, lifting its right child.
+ * param[in] node The root of the subtree
+ * return The new root of the subtree
+ */
+static block_t *tree_rotate_left(block_t *node) {
+    block_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    tree_update(node);
+    tree_update(right);
+    return right;
+}
+
+/**
+ * Restores the AVL balance of a subtree after one of its children changed
+ * height by at most one.
+ *
+ * param[in] node The root of the subtree
+ * return The new root of the subtree
+ */
+static block_t *tree_balance(block_t *node) {
+    size_t hl = tree_height(node->left);
+    size_t hr = tree_height(node->right);
+
+    if (hl > hr + 1) {
+        if (tree_height(node->left->left) < tree_height(node->left->right)) {
+            node->left = tree_rotate_left(node->left);
+        }
+        return tree_rotate_right(node);
+    }
+    if (hr > hl + 1) {
+        if (tree_height(node->right->right) < tree_height(node->right->left)) {
+            node->right = tree_rotate_right(node->right);
+        }
+        return tree_rotate_left(node);
+    }
+    tree_update(node);
+    return node;
+}
+
+/**
+ * Inserts a large free block into a subtree.
+ *
+ * param[in] root The root of the subtree, or NULL
+ * param[in] block The free block waiting to be inserted
+ * return The new root of the subtree
+ */
+static block_t *tree_insert(block_t *root, block_t *block) {
+    if (root == NULL) {
+        block->left = NULL;
+        block->right = NULL;
+        block->height = 1;
+        return block;
+    }
+    if (tree_less(block, root)) {
+        root->left = tree_insert(root->left, block);
+    } else {
+        root->right = tree_insert(root->right, block);
+    }
+    return tree_balance(root);
+}
+
+/**
+ * Unlinks the smallest block of a non-empty subtree.
+ *
+ * param[in] root The root of the subtree
+ * param[out] min The block that was unlinked
+ * return The new root of the subtree
+ */
+static block_t *tree_remove_min(block_t *root, block_t **min) {
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = tree_remove_min(root->left, min);
+    return tree_balance(root);
+}
+
+/**
+ * Removes a large free block from a subtree.
+ *
+ * The block must still have the size it was inserted with, since the
+ * search follows the (size, address) order.
+ *
+ * param[in] root The root of the subtree containing block
+ * param[in] block The free block that has been used
+ * return The new root of the subtree
+ */
+static block_t *tree_remove(block_t *root, block_t *block) {
+    dbg_requires(root != NULL);
+
+    if (root == block) {
+        if (root->left == NULL) {
+            return root->right;
+        }
+        if (root->right == NULL) {
+            return root->left;
+        }
+        // replace the block by its successor
+        block_t *succ;
+        block_t *right = tree_remove_min(root->right, &succ);
+        succ->left = root->left;
+        succ->right = right;
+        return tree_balance(succ);
+    }
+    if (tree_less(block, root)) {
+        root->left = tree_remove(root->left, block);
     } else {
-        return 13;
+        root->right = tree_remove(root->right, block);
+    }
+    return tree_balance(root);
+}
+
+/**
+ * the fundamental function of insert_free (for the large-block tree only)
+ *
+ * param[in] block The free block waiting to be inserted
+ * param[in] i The index of the tree root in free_list_start
+ */
+static void insert_free_tree(block_t *block, int i) {
+    dbg_requires(block != NULL);
+    free_lists_t *lists = get_lists();
+
+    lists->free_list_start[i] = tree_insert(lists->free_list_start[i], block);
+    lists->free_list_bitmap |= (word_t)1 << i;
+}
+
+/**
+ * the fundamental function of clear_free (for the large-block tree only)
+ *
+ * param[in] block The free block that has been used
+ * param[in] i The index of the tree root in free_list_start
+ */
+static void clear_free_tree(block_t *block, int i) {
+    dbg_requires(block != NULL);
+    free_lists_t *lists = get_lists();
+
+    lists->free_list_start[i] = tree_remove(lists->free_list_start[i], block);
+    if (lists->free_list_start[i] == NULL) {
+        lists->free_list_bitmap &= ~((word_t)1 << i);
     }
 }
 
@@ -459,22 +1052,24 @@ int get_free_list(size_t size) {
  */
 block_t *insert_free_basic(block_t *block, int i) {
     dbg_requires(block != NULL);
+    free_lists_t *lists = get_lists();
 
-    if (free_list_start[i] == NULL) {
-        block->prev = block;
-        block->next = block;
-        free_list_start[i] = block;
+    if (lists->free_list_start[i] == NULL) {
+        set_prev_link(block, block);
+        set_next_link(block, block);
+        lists->free_list_start[i] = block;
+        lists->free_list_bitmap |= (word_t)1 << i;
     } else {
         // LIFO
-        block_t *old_start = free_list_start[i];
-        block_t *old_end = old_start->prev;
-        block->prev = old_end;
-        old_end->next = block;
-        block->next = old_start;
-        old_start->prev = block;
-        free_list_start[i] = block;
+        block_t *old_start = lists->free_list_start[i];
+        block_t *old_end = get_prev_link(old_start);
+        set_prev_link(block, old_end);
+        set_next_link(old_end, block);
+        set_next_link(block, old_start);
+        set_prev_link(old_start, block);
+        lists->free_list_start[i] = block;
     }
-    return free_list_start[i];
+    return lists->free_list_start[i];
 }
 
 /**
@@ -488,22 +1083,48 @@ block_t *insert_free_basic(block_t *block, int i) {
  */
 block_t *insert_free_mini(block_t *block, int i) {
     dbg_requires(block != NULL);
+    free_lists_t *lists = get_lists();
 
-    if (free_list_start[i] == NULL) {
-        block->next = block;
-        free_list_start[i] = block;
+    if (lists->free_list_start[i] == NULL) {
+        set_next_link(block, block);
+        set_mini_prev(block, block);
+        lists->free_list_start[i] = block;
+        lists->free_list_bitmap |= (word_t)1 << i;
     } else {
         // LIFO
-        block_t *old_start = free_list_start[i];
-        block->next = old_start;
-        free_list_start[i] = block;
+        block_t *old_start = lists->free_list_start[i];
+        block_t *old_end = get_mini_prev(old_start);
+        set_mini_prev(block, old_end);
+        set_next_link(old_end, block);
+        set_next_link(block, old_start);
+        set_mini_prev(old_start, block);
+        lists->free_list_start[i] = block;
+    }
+    return lists->free_list_start[i];
+}
+
+/**
+ * Logs the neighbours of a block in its free list, whose links change when
+ * the block is inserted or removed; does nothing unless built with DEBUG.
+ *
+ * param[in] block A block in free list i
+ * param[in] i
+ */
+static void mark_dirty_links(block_t *block, int i) {
+#ifdef DEBUG
+    if (i == (int)free_size - 1) {
+        return;
     }
-    return free_list_start[i];
+    mark_dirty(get_next_link(block));
+    mark_dirty((i == 0) ? get_mini_prev(block) : get_prev_link(block));
+#endif
 }
 
 /**
  * Use First in First out rule to insert a free block to free list
  *
+ * A block other than a mini block that ends the heap becomes the top chunk
+ * instead, and goes in no list.
  *
  * param[in] block The free block waiting to be inserted
  * pre block is not NULL
@@ -512,12 +1133,30 @@ static void insert_free(block_t *block) {
     dbg_requires(block != NULL);
 
     size_t size = get_size(block);
+    heap_state_t *state = get_state();
+    free_lists_t *lists = get_lists();
+
+    // A block followed by the epilogue becomes the top chunk instead
+    block_t *next = (block_t *)((char *)block + size);
+    if (size != min_block_size && get_size(next) == 0) {
+        dbg_assert(state->top == NULL);
+        state->top = block;
+        mark_dirty(block);
+        return;
+    }
+
     int i = get_free_list(size);
+    lists->free_list_bytes[i] += size;
+    lists->free_count++;
     if (i == 0) {
         insert_free_mini(block, i);
+    } else if (i == (int)free_size - 1) {
+        insert_free_tree(block, i);
     } else {
         insert_free_basic(block, i);
     }
+    mark_dirty(block);
+    mark_dirty_links(block, i);
 }
 
 /**
@@ -530,39 +1169,43 @@ static void insert_free(block_t *block) {
  */
 block_t *clear_free_basic(block_t *block, int i) {
     dbg_requires(block != NULL);
+    free_lists_t *lists = get_lists();
 
-    if (free_list_start[i] == NULL) {
+    if (lists->free_list_start[i] == NULL) {
         return NULL;
     }
 
-    block_t *prev_block = block->prev;
-    block_t *next_block = block->next;
+    block_t *prev_block = get_prev_link(block);
+    block_t *next_block = get_next_link(block);
 
     if (prev_block == next_block) {
         // one block
         if (prev_block == block) {
-            free_list_start[i] = NULL;
+            lists->free_list_start[i] = NULL;
+            lists->free_list_bitmap &= ~((word_t)1 << i);
         } else {
             // two blocks
-            prev_block->prev = prev_block;
-            prev_block->next = prev_block;
-            free_list_start[i] = prev_block;
+            set_prev_link(prev_block, prev_block);
+            set_next_link(prev_block, prev_block);
+            lists->free_list_start[i] = prev_block;
         }
     }
 
     // multple blocks
-    prev_block->next = next_block;
-    next_block->prev = prev_block;
-    if (block == free_list_start[i]) {
-        free_list_start[i] = next_block;
+    set_next_link(prev_block, next_block);
+    set_prev_link(next_block, prev_block);
+    if (block == lists->free_list_start[i]) {
+        lists->free_list_start[i] = next_block;
     }
 
-    return free_list_start[i];
+    return lists->free_list_start[i];
 }
 
 /**
  * the fundamental function of clear_free (only for mini block)
  *
+ * The prev link is read from the block's header, so no list walk is needed.
+ *
  * param[in] block The free block has been used
  * param[in] free_list_start The free list the block is in
  * pre block is not NULL
@@ -570,37 +1213,34 @@ block_t *clear_free_basic(block_t *block, int i) {
  */
 block_t *clear_free_mini(block_t *block, int i) {
     dbg_requires(block != NULL);
+    free_lists_t *lists = get_lists();
 
-    if (free_list_start[i] == NULL) {
+    if (lists->free_list_start[i] == NULL) {
         return NULL;
     }
 
-    block_t *next_block = block->next;
+    block_t *prev_block = get_mini_prev(block);
+    block_t *next_block = get_next_link(block);
 
     if (block == next_block) {
         // one block
-        free_list_start[i] = NULL;
-        return free_list_start[i];
+        lists->free_list_start[i] = NULL;
+        lists->free_list_bitmap &= ~((word_t)1 << i);
+        return lists->free_list_start[i];
     }
 
     // multple blocks
-    if (block == free_list_start[i]) {
-        free_list_start[i] = next_block;
-    } else {
-        // find where the block stays
-        for (block_t *bl = free_list_start[i]; bl != bl->next; bl = bl->next) {
-            if (bl->next == block) {
-                bl->next = next_block;
-                break;
-            }
-        }
+    set_next_link(prev_block, next_block);
+    set_mini_prev(next_block, prev_block);
+    if (block == lists->free_list_start[i]) {
+        lists->free_list_start[i] = next_block;
     }
 
-    return free_list_start[i];
+    return lists->free_list_start[i];
 }
 
 /**
- * pull the free block used out of the free list
+ * pull the free block used out of the free list, or out of the top chunk
  *
  * param[in] block The free block that has been used
  * pre block is not NULL
@@ -608,10 +1248,22 @@ block_t *clear_free_mini(block_t *block, int i) {
 static void clear_free(block_t *block) {
     dbg_requires(block != NULL);
 
+    heap_state_t *state = get_state();
+    free_lists_t *lists = get_lists();
+    if (block == state->top) {
+        state->top = NULL;
+        return;
+    }
+
     size_t size = get_size(block);
     int i = get_free_list(size);
+    lists->free_list_bytes[i] -= size;
+    lists->free_count--;
+    mark_dirty_links(block, i);
     if (i == 0) {
         clear_free_mini(block, i);
+    } else if (i == (int)free_size - 1) {
+        clear_free_tree(block, i);
     } else {
         clear_free_basic(block, i);
     }
@@ -647,7 +1299,7 @@ static block_t *find_next_free(block_t *block) {
     dbg_requires(block != NULL);
     dbg_requires(get_size(block) != 0 &&
                  "Called find_next on the last block in the heap");
-    return block->next;
+    return get_next_link(block);
 }
 
 /**
@@ -710,20 +1362,19 @@ static void free2alloc(block_t *block, size_t size, bool prev, bool alloc) {
         // prev block is allocated
         block->header = pack(size, true, alloc, is_min);
     }
+    mark_dirty(block);
 }
 
 static void modify_next(block_t *next, bool prev, bool is_min) {
     size_t size = get_size(next);
     bool alloc = get_alloc(next, false);
-    if (size != 0) {
-        next->header = pack(size, prev, alloc, is_min);
-        if ((!alloc) && (size != min_block_size)) {
-            word_t *footerp = header_to_footer(next);
-            *footerp = pack(size, prev, alloc, is_min);
-        }
-    } else {
-        next->header = pack(size, prev, alloc, is_min);
+    // only the status bits change, so a free mini block keeps its prev link
+    next->header = (next->header & ~alloc_mask) | pack(0, prev, alloc, is_min);
+    if ((size != 0) && (!alloc) && (size != min_block_size)) {
+        word_t *footerp = header_to_footer(next);
+        *footerp = pack(size, prev, alloc, is_min);
     }
+    mark_dirty(next);
 }
 
 /**
@@ -776,7 +1427,7 @@ static block_t *find_prev(block_t *block) {
 static block_t *find_prev_free(block_t *block) {
     dbg_requires(block != NULL);
 
-    return block->prev;
+    return get_prev_link(block);
 }
 
 /*
@@ -812,6 +1463,7 @@ static block_t *coalesce_block(block_t *block) {
         }
         // case 1: prev + next both free
         if (!get_alloc(next, false)) {
+            count_stat(stat_coalesce, 1);
             prev_alloc = get_prev_alloc(prev);
             dbg_assert(prev_alloc == 1);
             size = get_size(prev) + get_size(block) + get_size(next);
@@ -827,6 +1479,7 @@ static block_t *coalesce_block(block_t *block) {
         }
         // case 2: only prev free
         else {
+            count_stat(stat_coalesce + 1, 1);
             prev_alloc = get_prev_alloc(prev);
             dbg_assert(prev_alloc == 1);
             size = get_size(prev) + get_size(block);
@@ -843,6 +1496,7 @@ static block_t *coalesce_block(block_t *block) {
         // prev is not a free block
         // case 3: only next free
         if (!get_alloc(next, false)) {
+            count_stat(stat_coalesce + 2, 1);
             prev_alloc = get_prev_alloc(block);
             size = get_size(block) + get_size(next);
             clear_free(block);
@@ -854,38 +1508,117 @@ static block_t *coalesce_block(block_t *block) {
             modify_next(find_next(block), false, prev_min);
         }
         // case 4: prev + next both not free -> just return
+        else {
+            count_stat(stat_coalesce + 3, 1);
+        }
     }
     return block;
 }
 
 /**
- * enlarge heap as blocks require more memory
+ * switch the links of every free list from 32-bit offsets to full pointers
  *
- * param[in] size
- * post block is NULL or is right after the previous epilogue
- * return the new block that is added after the heap is extended (NULL if
- * failed)
+ * Each block's links are read before they are rewritten, so the lists can
+ * be followed while they are converted. The tree and the fast bins always
+ * use full pointers.
  */
-static block_t *extend_heap(size_t size) {
+static void widen_links(void) {
+    heap_state_t *state = get_state();
+    free_lists_t *lists = get_lists();
+    char *base = (char *)heap_start;
+
+    for (size_t i = 0; i < free_size - 1; i++) {
+        block_t *start = lists->free_list_start[i];
+        if (start == NULL) {
+            continue;
+        }
+        block_t *block = start;
+        do {
+            block_t *next = (block_t *)(base + block->next_link * dsize);
+            // a mini block's prev link lives in its header already
+            if (i != 0) {
+                block->prev = (block_t *)(base + block->prev_link * dsize);
+            }
+            block->next = next;
+            block = next;
+        } while (block != start);
+    }
+    state->link_limit = NULL;
+}
+
+/**
+ * enlarge heap as blocks require more memory
+ *
+ * param[in] size
+ * post block is NULL or is right after the previous epilogue
+ * return the new block that is added after the heap is extended (NULL if
+ * failed)
+ */
+static block_t *extend_heap(size_t size) {
     void *bp;
+    char *zero_lo = mem_zero_lo();
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
+    count_stat(stat_extends, 1);
+    count_stat(stat_extend_bytes, size);
+
+    // Narrow links cannot reach blocks past link_limit
+    heap_state_t *state = get_state();
+    char *brk = (char *)mem_heap_hi() + 1;
+    if (state->link_limit != NULL &&
+        size > (size_t)(state->link_limit - brk)) {
+        widen_links();
+    }
+
     if ((bp = mem_sbrk(size)) == (void *)-1) {
         return NULL;
     }
+    state->grow_count++;
+    state->grow_bytes += size;
 
-    // Initialize free block header/footer
+    // Create new epilogue header first, so the new block is seen to end
+    // the heap
     block_t *block = payload_to_header(bp);
+    size_t block_size = size;
     bool prev_alloc = get_prev_alloc(block);
-    alloc2free(block, size, prev_alloc, false);
-
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_epilogue(block_next, false);
+    write_epilogue((block_t *)((char *)block + size), false);
+
+    // The new space joins the block before it if that is free: the top
+    // chunk, or a mini block
+    if (!prev_alloc) {
+        block_t *prev = is_minblock(block)
+                            ? (block_t *)((char *)block - dsize)
+                            : find_prev(block);
+        clear_free(prev);
+        block_size += get_size(prev);
+        prev_alloc = get_prev_alloc(prev);
+        block = prev;
+    }
 
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block);
+    // Initialize free block header/footer; it becomes the top chunk
+    alloc2free(block, block_size, prev_alloc, false);
+
+    // Keep the zero frontier: up to four words around the old break have
+    // been written, and the new space is zero only from zero_lo
+    char *old_brk = (char *)bp;
+    char *dirty_hi = old_brk + 4 * wsize;
+    if (zero_lo <= old_brk && state->zero_frontier <= old_brk - dsize) {
+        // the zero run inside the old top block carries on into the new
+        // space once the words written around the old break are cleared
+        char *clear_hi = old_brk + size - dsize;
+        if (dirty_hi < clear_hi) {
+            clear_hi = dirty_hi;
+        }
+        memset(old_brk - dsize, 0, (size_t)(clear_hi - (old_brk - dsize)));
+    } else {
+        if (zero_lo > state->zero_frontier) {
+            state->zero_frontier = zero_lo;
+        }
+        if (dirty_hi > state->zero_frontier) {
+            state->zero_frontier = dirty_hi;
+        }
+    }
 
     return block;
 }
@@ -908,7 +1641,10 @@ static void split_block(block_t *block, size_t asize) {
 
     if ((block_size - asize) >= min_block_size) {
         block_t *block_next;
-        free2alloc(block, asize, prev_alloc, true);
+        count_stat(stat_splits, 1);
+        // block is already out of the free lists; only shrink its header
+        block->header = pack(asize, prev_alloc, true, is_minblock(block));
+        mark_dirty(block);
         if (asize == min_block_size) {
             prev_min = true;
         }
@@ -926,6 +1662,314 @@ static void split_block(block_t *block, size_t asize) {
     dbg_ensures(get_alloc(block, false));
 }
 
+/**
+ * check whether an allocated block lives in a region from mem_map
+ *
+ * param[in] block an allocated block
+ * return true if the block was made by map_block
+ */
+static bool is_mapped(block_t *block) {
+    return (block->header & (mapped_mask | alloc_mask_curr)) ==
+           (mapped_mask | alloc_mask_curr);
+}
+
+/**
+ * allocate a block in a new region of its own
+ *
+ * The region is a whole number of pages. Its first word is padding so the
+ * payload stays dsize aligned, and the header after it records the size of
+ * the whole region. The region is zero, as from mem_map.
+ *
+ * param[in] size the requested payload size
+ * return the new block, or NULL if no region could be mapped
+ */
+static block_t *map_block(size_t size) {
+    size_t pagesize = mem_pagesize();
+    if (size > (size_t)-1 - dsize - pagesize) {
+        return NULL;
+    }
+    size_t rsize = round_up(size + dsize, pagesize);
+
+    char *region = mem_map(rsize);
+    if (region == (void *)-1) {
+        return NULL;
+    }
+    block_t *block = (block_t *)(region + wsize);
+    block->header = rsize | mapped_mask | alloc_mask_curr;
+    return block;
+}
+
+/**
+ * give the region of a mapped block back to memlib
+ *
+ * param[in] block a block made by map_block
+ */
+static void unmap_block(block_t *block) {
+    dbg_requires(is_mapped(block));
+    mem_unmap((char *)block - wsize, get_size(block));
+}
+
+/**
+ * give the tail of a large free block back to memlib if it ends the heap
+ *
+ * The block keeps chunksize bytes, plus whatever is needed to release a
+ * whole number of chunks.
+ *
+ * param[in] block a free, coalesced block
+ */
+static void trim_heap(block_t *block) {
+    size_t size = get_size(block);
+    if (size < trim_threshold || get_size(find_next(block)) != 0) {
+        return;
+    }
+
+    size_t release = (size - chunksize) / chunksize * chunksize;
+    bool prev_alloc = get_prev_alloc(block);
+    clear_free(block);
+    if (mem_sbrk(-(intptr_t)release) == (void *)-1) {
+        insert_free(block);
+        return;
+    }
+    // the epilogue goes first, so the block is seen to end the heap
+    write_epilogue((block_t *)((char *)block + size - release), false);
+    alloc2free(block, size - release, prev_alloc, false);
+
+    // Demand has dropped, so growth starts over from chunksize
+    heap_state_t *state = get_state();
+    state->trim_count++;
+    state->grow_step = chunksize;
+}
+
+/**
+ * choose how much to grow the heap by for a request that found no fit
+ *
+ * The step doubles after every growth, but every free resets it to
+ * chunksize, so it only grows under sustained demand: back-to-back
+ * growths with no free in between. A run of allocations then needs only
+ * a logarithmic number of mem_sbrk calls, while a heap that frees as it
+ * grows keeps growing by chunksize and stays tight. The step never
+ * exceeds 1 / 2^shift of the heap, which bounds the unused tail a growth
+ * can leave.
+ *
+ * param[in] asize the adjusted size of the request
+ * return the number of bytes to extend the heap by
+ */
+static size_t grow_size(size_t asize) {
+    heap_state_t *state = get_state();
+    size_t size = max(asize, state->grow_step);
+    if (grow_adaptive) {
+        size_t cap = round_up(mem_heapsize() >> grow_cap_shift, dsize);
+        state->grow_step = max(chunksize, min(2 * state->grow_step, cap));
+    }
+    return size;
+}
+
+/**
+ * free an allocated block for real: write its boundary tags, update the
+ * next block and coalesce
+ *
+ * param[in] block an allocated block, not in a fast bin
+ */
+static void release_block(block_t *block) {
+    size_t size = get_size(block);
+    bool prev_min = (size == min_block_size);
+
+    // Demand has paused, so the next growth starts over from chunksize
+    get_state()->grow_step = chunksize;
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block, false));
+
+    // Mark the block as free
+    bool prev_alloc = get_prev_alloc(block);
+    alloc2free(block, size, prev_alloc, false);
+    modify_next(find_next(block), false, prev_min);
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(block);
+    trim_heap(block);
+}
+
+/**
+ * release every block in the fast bins and coalesce them
+ */
+static void consolidate_fast(void) {
+    heap_state_t *state = get_state();
+
+    for (size_t i = 0; i < fast_count; i++) {
+        block_t *block = state->fast_bins[i];
+        state->fast_bins[i] = NULL;
+        while (block != NULL) {
+            block_t *next = block->next;
+            release_block(block);
+            block = next;
+        }
+    }
+    state->fast_bytes = 0;
+}
+
+/**
+ * push a freed small block onto its fast bin
+ *
+ * The block stays marked allocated, so neither its tags nor its neighbours
+ * change. Crossing fast_limit consolidates all bins.
+ *
+ * param[in] block an allocated block of at most fast_max bytes
+ */
+static void push_fast(block_t *block) {
+    heap_state_t *state = get_state();
+    size_t size = get_size(block);
+    size_t i = size / dsize - 1;
+
+    state->grow_step = chunksize; // as in release_block
+    block->next = state->fast_bins[i];
+    state->fast_bins[i] = block;
+    state->fast_bytes += size;
+    if (state->fast_bytes > fast_limit) {
+        consolidate_fast();
+    }
+}
+
+/**
+ * pop a block of exactly asize bytes from its fast bin
+ *
+ * param[in] asize a block size of at most fast_max bytes
+ * return the block, still marked allocated, or NULL if the bin is empty
+ */
+static block_t *pop_fast(size_t asize) {
+    heap_state_t *state = get_state();
+    size_t i = asize / dsize - 1;
+    block_t *block = state->fast_bins[i];
+
+    if (block != NULL) {
+        state->fast_bins[i] = block->next;
+        state->fast_bytes -= asize;
+    }
+    return block;
+}
+
+/**
+ * Copies a payload to a lower (or the same) address.
+ *
+ * The copy runs word by word from the front, so the source and destination
+ * may overlap; memcpy makes no such promise.
+ *
+ * param[out] dst
+ * param[in] src
+ * param[in] n number of bytes, a multiple of wsize
+ */
+static void move_payload(void *dst, const void *src, size_t n) {
+    dbg_requires(dst <= src);
+    word_t *d = (word_t *)dst;
+    const word_t *s = (const word_t *)src;
+    for (size_t i = 0; i < n / wsize; i++) {
+        d[i] = s[i];
+    }
+}
+
+/**
+ * shrink an allocated block in place
+ *
+ * The tail beyond asize, if big enough to be a block, goes back to the free
+ * lists and is coalesced with a free successor.
+ *
+ * param[in] block an allocated block
+ * param[in] asize the new size, at most the block's size
+ */
+static void shrink_block(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block, false));
+
+    if ((get_size(block) - asize) >= min_block_size) {
+        split_block(block, asize);
+        trim_heap(coalesce_block(find_next(block)));
+    }
+}
+
+/**
+ * grow an allocated block in place, forwards
+ *
+ * A free successor is absorbed. If that is not enough but the block (or the
+ * free successor) is the last one in the heap, the heap is extended by the
+ * shortfall first. Whatever exceeds asize is split off again.
+ *
+ * param[in] block an allocated block
+ * param[in] asize the new size, larger than the block's size
+ * return true if the block now has at least asize bytes
+ */
+static bool grow_block(block_t *block, size_t asize) {
+    size_t block_size = get_size(block);
+    block_t *next = find_next(block);
+    size_t next_size = get_alloc(next, false) ? 0 : get_size(next);
+
+    if (block_size + next_size < asize) {
+        block_t *last = (next_size == 0) ? next : find_next(next);
+        if (get_size(last) != 0) {
+            return false;
+        }
+        // at least two words, so the new free block is never a mini block
+        size_t extendsize = max(asize - block_size - next_size, 2 * dsize);
+        if (extend_heap(extendsize) == NULL) {
+            return false;
+        }
+        next = find_next(block);
+        next_size = get_size(next);
+    }
+
+    size_t size = block_size + next_size;
+    clear_free(next);
+    block->header =
+        pack(size, get_prev_alloc(block), true, is_minblock(block));
+    mark_dirty(block);
+    modify_next(find_next(block), true, false);
+    split_block(block, asize);
+    return true;
+}
+
+/**
+ * grow an allocated block backwards into a free predecessor
+ *
+ * The predecessor, the block and a free successor are merged if together
+ * they hold asize bytes, and the payload is moved down to the start of the
+ * merged block. Whatever exceeds asize is split off again.
+ *
+ * param[in] block an allocated block
+ * param[in] asize the new size, larger than the block's size
+ * return the merged block, or NULL if the neighbours are too small
+ */
+static block_t *grow_block_back(block_t *block, size_t asize) {
+    if (get_prev_alloc(block)) {
+        return NULL;
+    }
+
+    block_t *prev;
+    if (is_minblock(block)) {
+        prev = (block_t *)((char *)block - dsize);
+    } else {
+        prev = find_prev(block);
+    }
+    block_t *next = find_next(block);
+    size_t next_size = get_alloc(next, false) ? 0 : get_size(next);
+    size_t block_size = get_size(block);
+    size_t size = get_size(prev) + block_size + next_size;
+
+    if (size < asize) {
+        return NULL;
+    }
+
+    bool prev_alloc = get_prev_alloc(prev);
+    bool prev_min = is_minblock(prev);
+    clear_free(prev);
+    if (next_size != 0) {
+        clear_free(next);
+    }
+    prev->header = pack(size, prev_alloc, true, prev_min);
+    mark_dirty(prev);
+    move_payload(prev->payload, block->payload, block_size - wsize);
+    modify_next(find_next(prev), true, false);
+    split_block(prev, asize);
+    return prev;
+}
+
 /**
  * the fundamental function of find_fit
  *
@@ -943,6 +1987,7 @@ static block_t *find_fit_basic(size_t asize, block_t *free_list_starter) {
     size_t sizeb;
     block = free_list_starter;
     sizeb = get_size(block);
+    count_stat(stat_nodes, 1);
 
     if (asize <= sizeb && (sizeb - asize <= free_16)) {
         return block;
@@ -962,9 +2007,11 @@ static block_t *find_fit_basic(size_t asize, block_t *free_list_starter) {
 
     for (; block != free_list_starter; block = find_next_free(block)) {
         sizeb = get_size(block);
+        count_stat(stat_nodes, 1);
         if (asize <= sizeb && (sizeb - asize) <= free_16) {
             return block;
         } else if (times == searchtime) {
+            count_stat(stat_capped, 1);
             if (init) {
                 return best;
             } else if (!init && (asize <= get_size(free_list_starter))) {
@@ -989,190 +2036,224 @@ static block_t *find_fit_basic(size_t asize, block_t *free_list_starter) {
 }
 
 /**
- * find am empty space to put in a block of asize [First Fit]
+ * best fit search in the large-block tree
+ *
+ * The smallest block of at least asize bytes is found by one descent,
+ * taking the lowest address among blocks of equal size.
  *
  * param[in] asize the desired size of the block wanna allocate
  * return the block or NULL
  */
-static block_t *find_fit(size_t asize) {
-    block_t *block;
-
-    if (asize <= free_16) {
-        size_t times = 0;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_32) {
-        size_t times = 1;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_48) {
-        size_t times = 2;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_64) {
-        size_t times = 3;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_128) {
-        size_t times = 4;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_256) {
-        size_t times = 5;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_512) {
-        size_t times = 6;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_1024) {
-        size_t times = 7;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_2048) {
-        size_t times = 8;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_4096) {
-        size_t times = 9;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_8192) {
-        size_t times = 10;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_16384) {
-        size_t times = 11;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else if (asize <= free_32768) {
-        size_t times = 12;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
-        }
-    } else {
-        size_t times = 13;
-        while (times < free_size) {
-            block = find_fit_basic(asize, free_list_start[times]);
-            if (block != NULL) {
-                return block;
-            }
-            times += 1;
+static block_t *find_fit_tree(size_t asize) {
+    free_lists_t *lists = get_lists();
+    block_t *best = NULL;
+    block_t *node = lists->free_list_start[free_size - 1];
+
+    while (node != NULL) {
+        if (get_size(node) >= asize) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
         }
     }
-    return block;
+    return best;
 }
 
 /**
- * check if all free lists are empty
+ * size of the largest block in the free lists
  *
- * return true if all are empty and false otherwise
+ * Only the highest non-empty class is looked at: the tree's largest node
+ * is its rightmost one, a list of a single size needs no search, and any
+ * other list is scanned.
+ *
+ * return the size, or 0 if the lists are empty
  */
-bool check_freenull() {
-    for (size_t i = 0; i < free_size; i++) {
-        if (free_list_start[i] != NULL) {
-            return false;
+static size_t largest_free(void) {
+    free_lists_t *lists = get_lists();
+    if (lists->free_list_bitmap == 0) {
+        return 0;
+    }
+    int c = 63 - __builtin_clzl(lists->free_list_bitmap);
+    block_t *start = lists->free_list_start[c];
+    if (c == (int)free_size - 1) {
+        while (start->right != NULL) {
+            start = start->right;
         }
+        return get_size(start);
     }
-    return true;
+    if (get_class_min(c) == class_bound[c]) {
+        return get_size(start);
+    }
+    size_t largest = 0;
+    block_t *block = start;
+    do {
+        largest = max(largest, get_size(block));
+        block = find_next_free(block);
+    } while (block != start);
+    return largest;
 }
 
-size_t check_minimatch(block_t *free_list_start, size_t size, size_t prevsize,
-                       int line, void *low, void *high) {
-    block_t *freeblock;
-    size_t count_free = 0;
-
-    if (free_list_start == NULL) {
-        return count_free;
+/**
+ * find am empty space to put in a block of asize
+ *
+ * Only the request's own class and the non-empty classes above it are
+ * visited: the bitmap is masked to those classes and each candidate list is
+ * picked with count-trailing-zeros. Any block in a higher class is large
+ * enough, so only the first list visited can come back empty-handed.
+ *
+ * param[in] asize the desired size of the block wanna allocate
+ * return the block or NULL
+ */
+static block_t *find_fit(size_t asize) {
+    free_lists_t *lists = get_lists();
+    int i = get_free_list(asize);
+    word_t candidates = lists->free_list_bitmap & (~(word_t)0 << i);
+
+    count_stat(stat_fits, 1);
+    while (candidates != 0) {
+        int c = __builtin_ctzl(candidates);
+        block_t *block;
+        count_stat(stat_lists, 1);
+        if (c == (int)free_size - 1) {
+            block = find_fit_tree(asize);
+        } else {
+            block = find_fit_basic(asize, lists->free_list_start[c]);
+        }
+        if (block != NULL) {
+            return block;
+        }
+        // drop the lowest candidate class
+        candidates &= candidates - 1;
     }
+    return NULL;
+}
 
-    freeblock = free_list_start;
-    // all free list pointers are between heap_lo and heap_hi
-    if ((void *)freeblock <= low) {
-        dbg_printf("line %d: free block exceeds lower limit of heap.\n", line);
-        return false;
+/**
+ * how far into a free block the header of an aligned block would go
+ *
+ * Payloads are dsize aligned and alignments above dsize are multiples of
+ * it, so the distance is 0 or at least min_block_size: the bytes before
+ * the aligned block always make a block of their own.
+ *
+ * param[in] block a free block
+ * param[in] align a power of two greater than dsize
+ * return the size of the leading fragment, less than align
+ */
+static size_t aligned_lead(block_t *block, size_t align) {
+    size_t payload = (size_t)header_to_payload(block);
+    size_t lead = round_up(payload, align) - payload;
+    dbg_assert(lead == 0 || lead >= min_block_size);
+    return lead;
+}
+
+/**
+ * find a free block with room for an aligned block of asize
+ *
+ * Each candidate list is scanned first fit for up to searchtime blocks,
+ * since a block's size alone doesn't say whether it fits. The tree is
+ * asked for a block large enough at any alignment.
+ *
+ * param[in] asize the adjusted size of the block
+ * param[in] align a power of two greater than dsize
+ * return the block or NULL
+ */
+static block_t *find_fit_aligned(size_t asize, size_t align) {
+    free_lists_t *lists = get_lists();
+    int i = get_free_list(asize);
+    word_t candidates = lists->free_list_bitmap & (~(word_t)0 << i);
+
+    while (candidates != 0) {
+        int c = __builtin_ctzl(candidates);
+        if (c == (int)free_size - 1) {
+            return find_fit_tree(asize + align);
+        }
+        block_t *start = lists->free_list_start[c];
+        block_t *block = start;
+        size_t times = 0;
+        do {
+            if (aligned_lead(block, align) + asize <= get_size(block)) {
+                return block;
+            }
+            block = find_next_free(block);
+        } while (block != start && ++times < searchtime);
+        candidates &= candidates - 1;
     }
-    if ((void *)freeblock >= (high - 7)) {
-        dbg_printf("line %d: free block exceeds upper limit of heap.\n", line);
-        return false;
+    return NULL;
+}
+
+/**
+ * take the top chunk for a request that no free list fits
+ *
+ * The block is carved from the low end of the top chunk, and split_block
+ * leaves the rest as the new top chunk, so growth-heavy phases allocate
+ * by bumping the start of the top chunk up without touching any list.
+ *
+ * param[in] asize the adjusted block size
+ * param[in] align a power of two greater than dsize the payload must be
+ *                 aligned to, or 0
+ * return the top chunk, or NULL if there is none or it is too small
+ */
+static block_t *find_top(size_t asize, size_t align) {
+    block_t *top = get_state()->top;
+    if (top == NULL) {
+        return NULL;
     }
+    size_t lead = (align == 0) ? 0 : aligned_lead(top, align);
+    return (lead + asize <= get_size(top)) ? top : NULL;
+}
 
-    // check first free block has the correct bucket size
-    if (((get_size(freeblock) > size) && (size != 0)) ||
-        get_size(freeblock) <= prevsize) {
-        dbg_printf("line %d: free block size doesn't match bucket size.\n",
-                   line);
-        return false;
+/**
+ * check if all free lists are empty
+ *
+ * return true if all are empty and false otherwise
+ */
+bool check_freenull() {
+    free_lists_t *lists = get_lists();
+    for (size_t i = 0; i < free_size; i++) {
+        if (lists->free_list_start[i] != NULL) {
+            return false;
+        }
     }
+    return true;
+}
 
-    freeblock = freeblock->next;
-    count_free += 1;
+size_t check_minimatch(block_t *free_list_start, size_t size, size_t prevsize,
+                       int line, void *low, void *high) {
+    block_t *freeblock;
+    block_t *prev;
+    block_t *next;
+    size_t count_free = 0;
+
+    if (free_list_start == NULL) {
+        return count_free;
+    }
+
+    freeblock = free_list_start;
+    do {
+        // every free mini block carries its prev link in the header
+        if ((freeblock->header & mini_free_mask) == 0) {
+            dbg_printf("line %d: free mini block has no prev link.\n", line);
+            return false;
+        }
+
+        // next, prev are consistent
+        next = find_next_free(freeblock);
+        if ((next->header & mini_free_mask) == 0 ||
+            get_mini_prev(next) != freeblock) {
+            dbg_printf(
+                "line %d: next free block's prev != current free block.\n",
+                line);
+            return false;
+        }
+        prev = get_mini_prev(freeblock);
+        if (find_next_free(prev) != freeblock) {
+            dbg_printf(
+                "line %d: prev free block's next != current free block.\n",
+                line);
+            return false;
+        }
 
-    for (; freeblock != freeblock->next; freeblock = freeblock->next) {
         // all free list pointers are between heap_lo and heap_hi
         if ((void *)freeblock <= low) {
             dbg_printf("line %d: free block exceeds lower limit of heap.\n",
@@ -1195,7 +2276,8 @@ size_t check_minimatch(block_t *free_list_start, size_t size, size_t prevsize,
 
         // count num of blocks in free list
         count_free += 1;
-    }
+        freeblock = next;
+    } while (freeblock != free_list_start);
 
     return count_free;
 }
@@ -1213,13 +2295,13 @@ size_t check_freematch(block_t *free_list_start, size_t size, size_t prevsize,
     // next, prev are consistent
     freeblock = free_list_start;
     next = find_next_free(freeblock);
-    if (next->prev != freeblock) {
+    if (find_prev_free(next) != freeblock) {
         dbg_printf("line %d: next free block's prev != current free block.\n",
                    line);
         return false;
     }
-    prev = freeblock->prev;
-    if (prev->next != freeblock) {
+    prev = find_prev_free(freeblock);
+    if (find_next_free(prev) != freeblock) {
         dbg_printf("line %d: prev free block's next != current free block.\n",
                    line);
         return false;
@@ -1250,14 +2332,14 @@ size_t check_freematch(block_t *free_list_start, size_t size, size_t prevsize,
          freeblock = find_next_free(freeblock)) {
         // next, prev are consistent
         next = find_next_free(freeblock);
-        if (next->prev != freeblock) {
+        if (find_prev_free(next) != freeblock) {
             dbg_printf(
                 "line %d: next free block's prev != current free block.\n",
                 line);
             return false;
         }
-        prev = freeblock->prev;
-        if (prev->next != freeblock) {
+        prev = find_prev_free(freeblock);
+        if (find_next_free(prev) != freeblock) {
             dbg_printf(
                 "line %d: prev free block's next != current free block.\n",
                 line);
@@ -1292,15 +2374,62 @@ size_t check_freematch(block_t *free_list_start, size_t size, size_t prevsize,
 }
 
 /**
+ * check a subtree of the large-block tree: order, heights, AVL balance,
+ * bounds and bucket size
  *
+ * param[in] node The root of the subtree, or NULL
+ * param[in] lo Every block in the subtree must come after lo (or NULL)
+ * param[in] hi Every block in the subtree must come before hi (or NULL)
  * param[in] line
- * return
+ * param[in] low
+ * param[in] high
+ * return the number of blocks in the subtree, 0 on error
  */
-bool mm_checkheap(int line) {
+size_t check_treematch(block_t *node, block_t *lo, block_t *hi, int line,
+                       void *low, void *high) {
+    if (node == NULL) {
+        return 0;
+    }
 
-    // prologue and epilogue
-    // prologue
-    word_t *prologue = (word_t *)mem_heap_lo();
+    if ((void *)node <= low || (void *)node >= (high - 7)) {
+        dbg_printf("line %d: tree block exceeds the heap.\n", line);
+        return false;
+    }
+    if (get_alloc(node, false) || get_size(node) <= class_bound[free_size - 2]) {
+        dbg_printf("line %d: tree block doesn't match bucket size.\n", line);
+        return false;
+    }
+    if ((lo != NULL && !tree_less(lo, node)) ||
+        (hi != NULL && !tree_less(node, hi))) {
+        dbg_printf("line %d: tree blocks out of order.\n", line);
+        return false;
+    }
+
+    size_t hl = tree_height(node->left);
+    size_t hr = tree_height(node->right);
+    if (node->height != 1 + max(hl, hr) || hl > hr + 1 || hr > hl + 1) {
+        dbg_printf("line %d: tree height or balance is wrong.\n", line);
+        return false;
+    }
+
+    return 1 + check_treematch(node->left, lo, node, line, low, high) +
+           check_treematch(node->right, node, hi, line, low, high);
+}
+
+/**
+ * check the state record, the prologue and the epilogue
+ *
+ * param[in] line
+ * return true if they are in place
+ */
+static bool check_ends(int line) {
+    // state record and prologue
+    heap_state_t *state = get_state();
+    if ((char *)state != (char *)mem_heap_lo()) {
+        dbg_printf("line %d: state record is not at heap start.\n", line);
+        return false;
+    }
+    word_t *prologue = (word_t *)heap_start - 1;
     if (prologue == NULL) {
         dbg_printf("line %d: prologue is NULL.\n", line);
         return false;
@@ -1327,12 +2456,181 @@ bool mm_checkheap(int line) {
         dbg_printf("line %d: epilogue not allocated.\n", line);
         return false;
     }
+    return true;
+}
+
+/**
+ * check the fast bins, the zero frontier and the reach of narrow links
+ *
+ * param[in] line
+ * param[in] low
+ * param[in] high
+ * return true if they are consistent
+ */
+static bool check_caches(int line, void *low, void *high) {
+    // fast bins hold allocated blocks of their own size
+    size_t fast_bytes = 0;
+    for (size_t i = 0; i < fast_count; i++) {
+        for (block_t *fast = get_state()->fast_bins[i]; fast != NULL;
+             fast = fast->next) {
+            if ((void *)fast <= low || (void *)fast >= (high - 7)) {
+                dbg_printf("line %d: fast bin block exceeds the heap.\n",
+                           line);
+                return false;
+            }
+            if (!get_alloc(fast, false) || get_size(fast) != (i + 1) * dsize) {
+                dbg_printf("line %d: fast bin block has the wrong tags.\n",
+                           line);
+                return false;
+            }
+            fast_bytes += get_size(fast);
+        }
+    }
+    if (fast_bytes != get_state()->fast_bytes) {
+        dbg_printf("line %d: fast bin byte count is wrong.\n", line);
+        return false;
+    }
+
+    // everything above the zero frontier is still zero
+    for (word_t *w = (word_t *)get_state()->zero_frontier;
+         (char *)w < (char *)high + 1 - dsize; w++) {
+        if (*w != 0) {
+            dbg_printf("line %d: non-zero word above the zero frontier.\n",
+                       line);
+            return false;
+        }
+    }
+
+    // narrow links must reach every block
+    char *link_limit = get_state()->link_limit;
+    if (link_limit != NULL && (char *)high >= link_limit) {
+        dbg_printf("line %d: heap has outgrown its narrow links.\n", line);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * check the free lists against the free blocks found in the heap
+ *
+ * param[in] line
+ * param[in] count The number of free blocks in the heap
+ * param[in] free_bytes Their total size
+ * param[in] low
+ * param[in] high
+ * return true if the lists hold exactly those blocks, in the right classes
+ */
+static bool check_lists(int line, size_t count, size_t free_bytes, void *low,
+                        void *high) {
+    heap_state_t *state = get_state();
+    free_lists_t *lists = get_lists();
+    size_t count_free = 0;
+
+    // the top chunk is the last block if that is free and not mini, and is
+    // in no list
+    block_t *epilogue = (block_t *)((char *)high - 7);
+    block_t *top = state->top;
+    if (top != NULL) {
+        if ((void *)top <= low || top >= epilogue || get_alloc(top, false) ||
+            find_next(top) != epilogue) {
+            dbg_printf("line %d: top chunk is not the last free block.\n",
+                       line);
+            return false;
+        }
+        count--;
+        free_bytes -= get_size(top);
+    } else if (!get_prev_alloc(epilogue) && !is_minblock(epilogue)) {
+        dbg_printf("line %d: last free block is not the top chunk.\n", line);
+        return false;
+    }
+
+    // the running totals for mm_heapinfo match the heap
+    size_t list_bytes = 0;
+    for (size_t i = 0; i < free_size; i++) {
+        list_bytes += lists->free_list_bytes[i];
+    }
+    if (list_bytes != free_bytes || lists->free_count != count) {
+        dbg_printf("line %d: free byte or block totals are wrong.\n", line);
+        return false;
+    }
+
+    // bitmap marks exactly the non-empty free lists
+    for (size_t i = 0; i < free_size; i++) {
+        bool marked = (lists->free_list_bitmap >> i) & 1;
+        if (marked != (lists->free_list_start[i] != NULL)) {
+            dbg_printf("line %d: free list bitmap wrong for list %d.\n", line,
+                       (int)i);
+            return false;
+        }
+    }
+    if ((lists->free_list_bitmap >> free_size) != 0) {
+        dbg_printf("line %d: free list bitmap has bits past the last list.\n",
+                   line);
+        return false;
+    }
+
+    if (count == 0 && (!check_freenull())) {
+        dbg_printf("line %d: heap has no free blocks but free list has.\n",
+                   line);
+        return false;
+    }
+
+    if (count != 0 && check_freenull()) {
+        dbg_printf("line %d: heap has free blocks but free list doesn't.\n",
+                   line);
+        return false;
+    }
+
+    if (!check_freenull()) {
+        block_t **starts = lists->free_list_start;
+        count_free +=
+            check_minimatch(starts[0], class_bound[0], 0, line, low, high);
+        for (size_t i = 1; i < free_size - 1; i++) {
+            count_free += check_freematch(starts[i], class_bound[i],
+                                          class_bound[i - 1], line, low, high);
+        }
+        count_free += check_treematch(starts[13], NULL, NULL, line, low, high);
+
+        if (count != count_free) {
+            dbg_printf("actual number : %d\n", (int)count);
+            dbg_printf("free list number : %d\n", (int)count_free);
+            dbg_printf("line %d: the number of free blocks doesn't match.\n",
+                       line);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * empty the log of touched blocks after a full heap check
+ */
+static void clear_dirty(void) {
+#ifdef DEBUG
+    heap_state_t *state = get_state();
+    state->dirty_count = 0;
+    state->checks = 0;
+#endif
+}
+
+/**
+ *
+ * param[in] line
+ * return
+ */
+bool mm_checkheap(int line) {
+
+    // prologue and epilogue
+    if (!check_ends(line)) {
+        return false;
+    }
 
     block_t *block;
     void *low = mem_heap_lo();
     void *high = mem_heap_hi();
     bool is_empty = false;
     size_t count = 0;
+    size_t free_bytes = 0;
 
     for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
 
@@ -1375,6 +2673,13 @@ bool mm_checkheap(int line) {
             return false;
         }
 
+        // only free mini blocks carry a prev link in their header
+        bool tagged = (header & mini_free_mask) != 0;
+        if (tagged != (!get_alloc(block, false) && size == min_block_size)) {
+            dbg_printf("line %d: mini block link flag is wrong.\n", line);
+            return false;
+        }
+
         if (size == min_block_size) {
             block_t *next = find_next(block);
             if (block != NULL) {
@@ -1400,59 +2705,75 @@ bool mm_checkheap(int line) {
         // count actual number of free blocks in heap
         if (!get_alloc(block, false)) {
             count += 1;
+            free_bytes += get_size(block);
         }
     }
 
-    // ---- check the free list below ----
-    size_t count_free = 0;
-
-    if (count == 0 && (!check_freenull())) {
-        dbg_printf("line %d: heap has no free blocks but free list has.\n",
-                   line);
+    if (!check_caches(line, low, high) ||
+        !check_lists(line, count, free_bytes, low, high)) {
         return false;
     }
 
-    if (count != 0 && check_freenull()) {
-        dbg_printf("line %d: heap has free blocks but free list doesn't.\n",
-                   line);
+    // everything touched so far has just been checked
+    clear_dirty();
+    return true;
+}
+
+/**
+ * check the tags of one block against its neighbours in the heap
+ *
+ * Only the block and the tags next to it are read, not the state record,
+ * so blocks far apart can be checked at the same time.
+ *
+ * param[in] block A block in the heap, not the epilogue
+ * param[in] line
+ * param[in] low
+ * param[in] high
+ * return true if the block is consistent with its neighbours
+ */
+static bool check_tags(block_t *block, int line, void *low, void *high) {
+    size_t size = get_size(block);
+    bool alloc = get_alloc(block, false);
+    bool prev_alloc = get_prev_alloc(block);
+
+    // the block lies within the heap and is a whole number of dsize
+    if (size < min_block_size || size % dsize != 0 ||
+        (char *)block + size > (char *)high - 7) {
+        dbg_printf("line %d: block %p has a bad size.\n", line,
+                   (void *)block);
+        return false;
+    }
+    bool tagged = (block->header & mini_free_mask) != 0;
+    if (tagged != (!alloc && size == min_block_size)) {
+        dbg_printf("line %d: mini block link flag is wrong.\n", line);
+        return false;
+    }
+    if (!alloc && size != min_block_size &&
+        *header_to_footer(block) != block->header) {
+        dbg_printf("line %d: header != footer.\n", line);
         return false;
     }
 
-    if (!check_freenull()) {
-        count_free +=
-            check_minimatch(free_list_start[0], free_16, 0, line, low, high);
-        count_free += check_freematch(free_list_start[1], free_32, free_16,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[2], free_48, free_32,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[3], free_64, free_48,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[4], free_128, free_64,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[5], free_256, free_128,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[6], free_512, free_256,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[7], free_1024, free_512,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[8], free_2048, free_1024,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[9], free_4096, free_2048,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[10], free_8192, free_4096,
-                                      line, low, high);
-        count_free += check_freematch(free_list_start[11], free_16384,
-                                      free_8192, line, low, high);
-        count_free += check_freematch(free_list_start[12], free_32768,
-                                      free_16384, line, low, high);
-        count_free += check_freematch(free_list_start[13], 0, free_32768, line,
-                                      low, high);
+    // the next block records this one's status
+    block_t *next = find_next(block);
+    if (get_prev_alloc(next) != alloc ||
+        is_minblock(next) != (size == min_block_size)) {
+        dbg_printf("line %d: next block's status bits are wrong.\n", line);
+        return false;
+    }
 
-        if (count != count_free) {
-            dbg_printf("actual number : %d\n", (int)count);
-            dbg_printf("free list number : %d\n", (int)count_free);
-            dbg_printf("line %d: the number of free blocks doesn't match.\n",
-                       line);
+    // a free block has allocated neighbours on both sides
+    if (!alloc && (!prev_alloc || !get_alloc(next, false))) {
+        dbg_printf("line %d: consecutive free blocks appear.\n", line);
+        return false;
+    }
+    if (!prev_alloc) {
+        block_t *prev = is_minblock(block)
+                            ? (block_t *)((char *)block - dsize)
+                            : find_prev(block);
+        if ((void *)prev <= low || get_alloc(prev, false) ||
+            find_next(prev) != block) {
+            dbg_printf("line %d: free prev block doesn't end here.\n", line);
             return false;
         }
     }
@@ -1460,223 +2781,1887 @@ bool mm_checkheap(int line) {
 }
 
 /**
- * initialize the heap to have prologue & epilogue
+ * check that a free block is linked both ways with its neighbours in its
+ * free list
  *
- * post return true then a valid empty heap
- * return true if succeed and false otherwise
+ * param[in] block A free block
+ * param[in] line
+ * param[in] low
+ * param[in] high
+ * return true if the links match
  */
-bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-
-    if (start == (void *)-1) {
+static bool check_links(block_t *block, int line, void *low, void *high) {
+    int i = get_free_list(get_size(block));
+    if (((get_lists()->free_list_bitmap >> i) & 1) == 0) {
+        dbg_printf("line %d: free block's list is marked empty.\n", line);
         return false;
     }
-
-    start[0] = pack(0, false, true, true); // Heap prologue (block footer)
-    start[1] = pack(0, true, true, true);  // Heap epilogue (block header)
-
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-
-    // initailize all free list pointers
-    for (size_t i = 0; i < free_size; i++) {
-        free_list_start[i] = NULL;
+    if (i == (int)free_size - 1) {
+        block_t *left = block->left;
+        block_t *right = block->right;
+        size_t hl = tree_height(left);
+        size_t hr = tree_height(right);
+        if ((left != NULL && !tree_less(left, block)) ||
+            (right != NULL && !tree_less(block, right)) ||
+            block->height != 1 + max(hl, hr) || hl > hr + 1 || hr > hl + 1) {
+            dbg_printf("line %d: tree node is out of order or balance.\n",
+                       line);
+            return false;
+        }
+        return true;
     }
-
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
+    block_t *next_free = get_next_link(block);
+    block_t *prev_free =
+        (i == 0) ? get_mini_prev(block) : get_prev_link(block);
+    if ((void *)next_free <= low || (void *)next_free >= high - 7 ||
+        (void *)prev_free <= low || (void *)prev_free >= high - 7) {
+        dbg_printf("line %d: free list link leaves the heap.\n", line);
+        return false;
+    }
+    block_t *back = (i == 0) ? get_mini_prev(next_free)
+                             : get_prev_link(next_free);
+    if (back != block || get_next_link(prev_free) != block) {
+        dbg_printf("line %d: free list links don't match.\n", line);
         return false;
     }
-
     return true;
 }
 
 /**
- * allocate a block with size in heap
+ * the heap check made on entry to and exit from each call in debug builds
  *
- * param[in] size
- * post if not enough memory return NULL
- *       allocated block should be previously free
- * return the payload of the allocated block
+ * Only the blocks logged by mark_dirty since the last check are looked at,
+ * in address order, skipping those that have since become part of a block
+ * checked before them. Every MM_CHECK_FULL-th check, and any check after
+ * the log has overflowed, is a full mm_checkheap instead.
+ *
+ * param[in] line
+ * return true if the heap is consistent as far as was checked
+ */
+static bool check_heap(int line) {
+#ifdef DEBUG
+    heap_state_t *state = get_state();
+    free_lists_t *lists = get_lists();
+    if (state->dirty_count > dirty_max || ++state->checks >= MM_CHECK_FULL) {
+        return mm_checkheap(line);
+    }
+
+    void *low = mem_heap_lo();
+    void *high = mem_heap_hi();
+    block_t *epilogue = (block_t *)((char *)high - 7);
+    if (get_size(epilogue) != 0 || !get_alloc(epilogue, false)) {
+        dbg_printf("line %d: epilogue is damaged.\n", line);
+        return false;
+    }
+    for (size_t i = 0; i < free_size; i++) {
+        bool marked = (lists->free_list_bitmap >> i) & 1;
+        if (marked != (lists->free_list_start[i] != NULL)) {
+            dbg_printf("line %d: free list bitmap wrong for list %d.\n", line,
+                       (int)i);
+            return false;
+        }
+    }
+
+    // sort the log by address
+    block_t **dirty = state->dirty;
+    size_t n = state->dirty_count;
+    for (size_t i = 1; i < n; i++) {
+        block_t *block = dirty[i];
+        size_t j = i;
+        for (; j > 0 && dirty[j - 1] > block; j--) {
+            dirty[j] = dirty[j - 1];
+        }
+        dirty[j] = block;
+    }
+
+    char *checked = NULL;
+    for (size_t i = 0; i < n; i++) {
+        block_t *block = dirty[i];
+        // inside the last block checked, or trimmed off the heap
+        if ((char *)block < checked || block >= epilogue) {
+            continue;
+        }
+        if ((void *)block <= low) {
+            dbg_printf("line %d: block exceeds lower limit of heap.\n", line);
+            return false;
+        }
+        bool listed = !get_alloc(block, false) && block != state->top;
+        if (!check_tags(block, line, low, high) ||
+            (listed && !check_links(block, line, low, high))) {
+            return false;
+        }
+        checked = (char *)block + get_size(block);
+    }
+    state->dirty_count = 0;
+    return true;
+#else
+    return mm_checkheap(line);
+#endif
+}
+
+/** a stretch of the heap checked by one thread of mm_checkheap_parallel */
+typedef struct {
+    block_t *start;       // first block, known from a free list
+    block_t *end;         // the next segment's first block, or the epilogue
+    const word_t *listed; // bit per dsize of the heap: a free list has it
+    char *base;           // address of bit 0 of listed
+    void *low;
+    void *high;
+    int line;
+    bool ok;
+    size_t free_blocks; // free blocks found in the segment
+    size_t free_bytes;  // and their total size
+} check_segment_t;
+
+/**
+ * walk one segment of the heap, checking the tags of every block, and that
+ * every free block is in a free list
+ *
+ * param[in,out] arg The check_segment_t of the segment
+ * return NULL
+ */
+static void *check_segment(void *arg) {
+    check_segment_t *seg = (check_segment_t *)arg;
+    block_t *block = seg->start;
+
+    seg->ok = false;
+    seg->free_blocks = 0;
+    seg->free_bytes = 0;
+    while (block < seg->end) {
+        if (!check_tags(block, seg->line, seg->low, seg->high)) {
+            return NULL;
+        }
+        if (!get_alloc(block, false)) {
+            size_t bit = (size_t)((char *)block - seg->base) / dsize;
+            if (((seg->listed[bit / 64] >> (bit % 64)) & 1) == 0) {
+                dbg_printf("line %d: free block %p is in no free list.\n",
+                           seg->line, (void *)block);
+                return NULL;
+            }
+            seg->free_blocks++;
+            seg->free_bytes += get_size(block);
+        }
+        block = find_next(block);
+    }
+    if (block != seg->end) {
+        dbg_printf("line %d: blocks overrun the free block at %p.\n",
+                   seg->line, (void *)seg->end);
+        return NULL;
+    }
+    seg->ok = true;
+    return NULL;
+}
+
+/**
+ * set the bit of a listed block, and make it the start of its segment if it
+ * is the lowest listed block there
+ *
+ * param[in] block A block from a free list
+ * param[in,out] listed
+ * param[in,out] starts The lowest listed block in each segment so far
+ * param[in] seg_len The length of a segment
+ * return false if the block lies outside the heap
+ */
+static bool list_block(block_t *block, word_t *listed, block_t **starts,
+                       size_t seg_len) {
+    char *base = (char *)heap_start;
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    if (block < heap_start || block >= epilogue) {
+        return false;
+    }
+    size_t offset = (size_t)((char *)block - base);
+    size_t bit = offset / dsize;
+    listed[bit / 64] |= (word_t)1 << (bit % 64);
+    size_t k = offset / seg_len;
+    if (starts[k] == NULL || block < starts[k]) {
+        starts[k] = block;
+    }
+    return true;
+}
+
+/**
+ * list_block every block of a subtree of the large-block tree
+ *
+ * param[in] node The root of the subtree, or NULL
+ * param[in,out] listed
+ * param[in,out] starts
+ * param[in] seg_len
+ * return false if a block lies outside the heap
+ */
+static bool list_tree(block_t *node, word_t *listed, block_t **starts,
+                      size_t seg_len) {
+    if (node == NULL) {
+        return true;
+    }
+    return list_block(node, listed, starts, seg_len) &&
+           list_tree(node->left, listed, starts, seg_len) &&
+           list_tree(node->right, listed, starts, seg_len);
+}
+
+/**
+ * check the whole heap as mm_checkheap does, walking it on several threads
+ *
+ * The free lists are walked first, to set a bit for each listed block and
+ * to find the lowest listed block in each of `threads` equal stretches of
+ * the heap; those blocks are known to start blocks, so each thread walks
+ * from one to the next. Each checks the tags of every block, and that every
+ * free block it meets has its bit set. A walk that doesn't land exactly on
+ * the next segment's block, or free block counts that don't match the
+ * lists, fail the check. Stretches without a free block go to the thread
+ * before them, and heaps too small to give each thread check_segment_min
+ * bytes are checked by mm_checkheap alone.
+ *
+ * param[in] line
+ * param[in] threads The number of threads to use
+ * return true if the heap is consistent
+ */
+bool mm_checkheap_parallel(int line, int threads) {
+    if (!check_ends(line)) {
+        return false;
+    }
+
+    void *low = mem_heap_lo();
+    void *high = mem_heap_hi();
+    char *base = (char *)heap_start;
+    block_t *epilogue = (block_t *)((char *)high - 7);
+    size_t span = (size_t)((char *)epilogue - base);
+    size_t nseg = (threads < 1) ? 1 : min((size_t)threads, check_threads_max);
+    nseg = min(nseg, span / check_segment_min);
+    if (nseg <= 1) {
+        return mm_checkheap(line);
+    }
+    size_t seg_len = round_up(span / nseg + 1, dsize);
+
+    size_t words = span / dsize / 64 + 1;
+    size_t map_size = round_up(words * sizeof(word_t), mem_pagesize());
+    word_t *listed = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (listed == MAP_FAILED) {
+        return mm_checkheap(line);
+    }
+
+    // mark every listed block, and find where each segment starts
+    heap_state_t *state = get_state();
+    free_lists_t *lists = get_lists();
+    block_t *starts[check_threads_max] = {NULL};
+    bool in_heap = list_tree(lists->free_list_start[free_size - 1], listed,
+                             starts, seg_len);
+    for (size_t i = 0; in_heap && i < free_size - 1; i++) {
+        block_t *start = lists->free_list_start[i];
+        block_t *block = start;
+        while (block != NULL && in_heap) {
+            in_heap = list_block(block, listed, starts, seg_len);
+            block = in_heap ? get_next_link(block) : NULL;
+            if (block == start) {
+                break;
+            }
+        }
+    }
+    if (in_heap && state->top != NULL) {
+        in_heap = list_block(state->top, listed, starts, seg_len);
+    }
+    if (!in_heap) {
+        dbg_printf("line %d: free list block exceeds the heap.\n", line);
+        munmap(listed, map_size);
+        return false;
+    }
+    starts[0] = heap_start;
+
+    check_segment_t segs[check_threads_max];
+    pthread_t tids[check_threads_max];
+    bool started[check_threads_max];
+    size_t n = 0;
+    for (size_t k = 0; k < nseg; k++) {
+        if (starts[k] == NULL) {
+            continue;
+        }
+        segs[n].start = starts[k];
+        segs[n].listed = listed;
+        segs[n].base = base;
+        segs[n].low = low;
+        segs[n].high = high;
+        segs[n].line = line;
+        if (n > 0) {
+            segs[n - 1].end = starts[k];
+        }
+        n++;
+    }
+    segs[n - 1].end = epilogue;
+
+    // the calling thread takes the first segment itself, and any segment
+    // a thread could not be started for
+    for (size_t k = 1; k < n; k++) {
+        started[k] =
+            pthread_create(&tids[k], NULL, check_segment, &segs[k]) == 0;
+    }
+    check_segment(&segs[0]);
+    for (size_t k = 1; k < n; k++) {
+        if (started[k]) {
+            pthread_join(tids[k], NULL);
+        } else {
+            check_segment(&segs[k]);
+        }
+    }
+    munmap(listed, map_size);
+
+    size_t count = 0;
+    size_t free_bytes = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (!segs[k].ok) {
+            return false;
+        }
+        count += segs[k].free_blocks;
+        free_bytes += segs[k].free_bytes;
+    }
+    if (!check_caches(line, low, high) ||
+        !check_lists(line, count, free_bytes, low, high)) {
+        return false;
+    }
+
+    clear_dirty();
+    return true;
+}
+
+/**
+ * initialize the heap to have prologue & epilogue
+ *
+ * post return true then a valid empty heap
+ * return true if succeed and false otherwise
+ */
+bool mm_init(void) {
+    // Create the initial empty heap: the state record, prologue, epilogue
+    heap_state_t *state =
+        (heap_state_t *)(mem_sbrk(sizeof(heap_state_t) + 2 * wsize));
+
+    if (state == (void *)-1) {
+        return false;
+    }
+
+    word_t *start = (word_t *)(state + 1);
+    start[0] = pack(0, false, true, true); // Heap prologue (block footer)
+    start[1] = pack(0, true, true, true);  // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    heap_start = (block_t *)&(start[1]);
+
+    // nothing is known to be zero until the first extension
+    state->zero_frontier = (char *)mem_heap_hi() + 1;
+    state->fast_bytes = 0;
+    state->grow_step = chunksize;
+    state->grow_count = 0;
+    state->grow_bytes = 0;
+    state->trim_count = 0;
+    state->link_limit = (char *)heap_start + ((size_t)1 << 32) * dsize;
+    for (size_t i = 0; i < fast_count; i++) {
+        state->fast_bins[i] = NULL;
+    }
+#if MM_STATS
+    for (size_t i = 0; i < stat_count; i++) {
+        state->stats[i] = 0;
+    }
+#endif
+#ifdef DEBUG
+    state->dirty_count = 0;
+    state->checks = 0;
+#endif
+
+    // initailize all free list pointers
+    free_lists_t *lists = get_lists();
+    for (size_t i = 0; i < free_size; i++) {
+        lists->free_list_start[i] = NULL;
+        lists->free_list_bytes[i] = 0;
+    }
+    lists->free_list_bitmap = 0;
+    lists->free_count = 0;
+    state->top = NULL;
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(chunksize) == NULL) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * find or make a free block of asize bytes and mark it allocated
+ *
+ * The zero frontier is left alone, so calloc can still see which bytes of
+ * the block are known to be zero.
+ *
+ * param[in] asize the adjusted block size
+ * return the allocated block, or NULL if the heap can't grow
+ */
+static block_t *place_block(size_t asize) {
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
+    bool prev_min = false;
+
+    if (asize == min_block_size) {
+        prev_min = true;
+    }
+
+    // A recently freed block of the same size is already allocated
+    if (asize <= fast_max) {
+        block = pop_fast(asize);
+        if (block != NULL) {
+            return block;
+        }
+    }
+
+    // Search the free list for a fit, consolidating the fast bins on a miss
+    block = find_fit(asize);
+    if (block == NULL && get_state()->fast_bytes != 0) {
+        consolidate_fast();
+        block = find_fit(asize);
+    }
+
+    // Then carve it from the top chunk, and only then grow the heap
+    if (block == NULL) {
+        block = find_top(asize, 0);
+    }
+    if (block == NULL) {
+        // Request at least the current growth step
+        extendsize = grow_size(asize);
+        block = extend_heap(extendsize);
+        // extend_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block, false));
+
+    // Mark block as allocated
+    size_t block_size = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+    free2alloc(block, block_size, prev_alloc, true);
+    modify_next(find_next(block), true, prev_min);
+
+    // Try to split the block if too large
+    split_block(block, asize);
+
+    return block;
+}
+
+/**
+ * cut as many blocks of asize bytes as a batch needs from one free block
+ *
+ * The free block leaves its list once, and whatever is left over after the
+ * last block goes back once, so a batch costs one list update rather than
+ * one per block.
+ *
+ * param[in] block a free block of at least asize bytes
+ * param[in] asize the adjusted block size
+ * param[in] n the number of blocks wanted
+ * param[out] ptrs filled in with the payloads of the blocks
+ * return the number of blocks cut, at least 1 and at most n
+ */
+static size_t carve_blocks(block_t *block, size_t asize, size_t n,
+                           void **ptrs) {
+    dbg_requires(!get_alloc(block, false));
+
+    size_t block_size = get_size(block);
+    size_t count = min(n, block_size / asize);
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_min = is_minblock(block);
+
+    clear_free(block);
+    for (size_t i = 0; i < count; i++) {
+        // the last block takes the rest, and is split below
+        size_t size = (i == count - 1) ? block_size - i * asize : asize;
+        block->header = pack(size, prev_alloc, true, prev_min);
+        mark_dirty(block);
+        ptrs[i] = header_to_payload(block);
+        if (i < count - 1) {
+            block = find_next(block);
+        }
+        prev_alloc = true;
+        prev_min = (asize == min_block_size);
+    }
+    modify_next(find_next(block), true, get_size(block) == min_block_size);
+    split_block(block, asize);
+    touch_block(block);
+    return count;
+}
+
+/**
+ * allocate an aligned block of asize bytes from a free block
+ *
+ * The bytes before the aligned block are split off and freed again, and
+ * the bytes after it are split off as by place_block.
+ *
+ * param[in] block a free block found by find_fit_aligned or extend_heap
+ * param[in] asize the adjusted block size
+ * param[in] align a power of two greater than dsize
+ * return the allocated block
+ */
+static block_t *place_aligned(block_t *block, size_t asize, size_t align) {
+    dbg_requires(!get_alloc(block, false));
+
+    size_t block_size = get_size(block);
+    size_t lead = aligned_lead(block, align);
+    bool prev_alloc = get_prev_alloc(block);
+    dbg_assert(lead + asize <= block_size);
+
+    free2alloc(block, block_size, prev_alloc, true);
+    modify_next(find_next(block), true, block_size == min_block_size);
+    if (lead != 0) {
+        // Cut the block in two allocated blocks, then free the first
+        block_t *aligned = (block_t *)((char *)block + lead);
+        block->header = pack(lead, prev_alloc, true, is_minblock(block));
+        aligned->header = pack(block_size - lead, true, true,
+                               lead == min_block_size);
+        mark_dirty(block);
+        mark_dirty(aligned);
+        modify_next(find_next(aligned), true,
+                    block_size - lead == min_block_size);
+        release_block(block);
+        block = aligned;
+    }
+
+    split_block(block, asize);
+    return block;
+}
+
+/**
+ * report the heap growth policy and what it has done since mm_init
+ *
+ * param[out] stats
+ */
+void mm_growth(mm_growth_t *stats) {
+    if (heap_start == NULL) {
+        mm_init();
+    }
+    heap_state_t *state = get_state();
+    stats->adaptive = grow_adaptive;
+    stats->step = state->grow_step;
+    stats->count = state->grow_count;
+    stats->bytes = state->grow_bytes;
+    stats->trims = state->trim_count;
+}
+
+/**
+ * report the hot-path counters since mm_init
+ *
+ * All of them are zero, and enabled false, unless mm.c is built with
+ * MM_STATS.
+ *
+ * param[out] stats
+ */
+void mm_stats(mm_stats_t *stats) {
+    if (heap_start == NULL) {
+        mm_init();
+    }
+    stats->enabled = MM_STATS;
+    stats->fits = get_stat(stat_fits);
+    stats->lists = get_stat(stat_lists);
+    stats->nodes = get_stat(stat_nodes);
+    stats->capped = get_stat(stat_capped);
+    stats->splits = get_stat(stat_splits);
+    for (int i = 0; i < 4; i++) {
+        stats->coalesce[i] = get_stat(stat_coalesce + i);
+    }
+    stats->extends = get_stat(stat_extends);
+    stats->extend_bytes = get_stat(stat_extend_bytes);
+}
+
+/**
+ * report the free space in the heap
+ *
+ * The byte and block totals are kept up to date by insert_free and
+ * clear_free, so only the largest free block has to be looked for. The
+ * top chunk counts as free, in no class.
+ *
+ * param[out] info
+ */
+void mm_heapinfo(mm_heapinfo_t *info) {
+    if (heap_start == NULL) {
+        mm_init();
+    }
+    heap_state_t *state = get_state();
+    free_lists_t *lists = get_lists();
+    info->free_bytes = 0;
+    for (int i = 0; i < (int)free_size; i++) {
+        info->class_min[i] = get_class_min(i);
+        info->class_bytes[i] = lists->free_list_bytes[i];
+        info->free_bytes += lists->free_list_bytes[i];
+    }
+    info->free_blocks = lists->free_count;
+    info->largest = largest_free();
+    info->top = 0;
+    if (state->top != NULL) {
+        info->top = get_size(state->top);
+        info->free_bytes += info->top;
+        info->free_blocks++;
+        info->largest = max(info->largest, info->top);
+    }
+    info->cached_bytes = state->fast_bytes;
+
+    size_t total = info->free_bytes + info->cached_bytes;
+    info->frag = 0;
+    if (total > 0) {
+        info->frag = 1.0 - (double)info->largest / (double)total;
+    }
+}
+
+/**
+ * allocate a block with size in heap
+ *
+ * param[in] size
+ * post if not enough memory return NULL
+ *       allocated block should be previously free
+ * return the payload of the allocated block
+ */
+void *malloc(size_t size) {
+    dbg_requires(check_heap(__LINE__));
+
+    size_t asize; // Adjusted block size
+    block_t *block;
+    void *bp = NULL;
+
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        mm_init();
+    }
+
+    // Ignore spurious request
+    if (size == 0) {
+        dbg_ensures(check_heap(__LINE__));
+        return bp;
+    }
+
+    // Huge requests get a region of their own
+    if (size >= map_threshold) {
+        block = map_block(size);
+        if (block != NULL) {
+            bp = header_to_payload(block);
+        }
+        dbg_ensures(check_heap(__LINE__));
+        return bp;
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + wsize, dsize);
+
+    block = place_block(asize);
+    if (block == NULL) {
+        return bp;
+    }
+    touch_block(block);
+
+    bp = header_to_payload(block);
+
+    dbg_ensures(check_heap(__LINE__));
+    return bp;
+}
+
+/**
+ *
+ * function: free the current block and coalesce
+ * argument: the block intended to free
+ * postcondition: the block is freed
+ *
+ * param[in] bp
+ * return NONE
+ */
+void free(void *bp) {
+    dbg_requires(check_heap(__LINE__));
+
+    if (bp == NULL) {
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+
+    // Mapped blocks go back to memlib; small blocks wait in a fast bin; the
+    // rest are freed right away
+    if (is_mapped(block)) {
+        unmap_block(block);
+    } else if (get_size(block) <= fast_max) {
+        push_fast(block);
+    } else {
+        release_block(block);
+    }
+
+    dbg_ensures(check_heap(__LINE__));
+}
+
+/**
+ *
+ * function: reallocate a block to targeted size
+ * arguments: the payload to be reallocated, the desired size
+ * postcondition: if size == 0, fun equals free ptr
+ *                if ptr == NULL, fun equals malloc(size)
+ *                shrinking splits off the tail in place
+ *                growing absorbs a free successor or extends the heap when
+ *                the block is last, else takes a free predecessor and
+ *                moves the data back
+ *                a mapped block is kept if its region size would not
+ *                change, and a block grown to map_threshold is moved to a
+ *                region of its own
+ *                other: malloc new block and free old one
+ *
+ * param[in] ptr
+ * param[in] size
+ * return new reallocated block (void*)
+ */
+void *realloc(void *ptr, size_t size) {
+    block_t *block = payload_to_header(ptr);
+    size_t copysize;
+    void *newptr;
+
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+
+    dbg_requires(check_heap(__LINE__));
+
+    size_t asize = round_up(size + wsize, dsize);
+    if (is_mapped(block)) {
+        if (size >= map_threshold &&
+            round_up(size + dsize, mem_pagesize()) == get_size(block)) {
+            return ptr;
+        }
+    } else if (asize <= get_size(block)) {
+        shrink_block(block, asize);
+        dbg_ensures(check_heap(__LINE__));
+        return ptr;
+    } else if (size < map_threshold) {
+        if (grow_block(block, asize)) {
+            touch_block(block);
+            dbg_ensures(check_heap(__LINE__));
+            return ptr;
+        }
+
+        block_t *moved = grow_block_back(block, asize);
+        if (moved != NULL) {
+            touch_block(moved);
+            dbg_ensures(check_heap(__LINE__));
+            return header_to_payload(moved);
+        }
+    }
+
+    // Otherwise, proceed with reallocation
+    newptr = malloc(size);
+
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL) {
+        return NULL;
+    }
+
+    // Copy the old data
+    copysize = get_payload_size(block); // gets size of old payload
+    if (size < copysize) {
+        copysize = size;
+    }
+    memcpy(newptr, ptr, copysize);
+
+    // Free the old block
+    free(ptr);
+
+    return newptr;
+}
+
+/**
+ *
+ * function: allocate block with all elements initialized to 0
+ * arguments: size of one element, size of total elements
+ * postcondition: allocated block is initialized
+ *                bytes at or above the zero frontier (and below the last
+ *                two words of the heap) are zero already and not cleared
+ *
+ * param[in] elements
+ * param[in] size
+ * return the allocated & intialized block or NULL
+ */
+void *calloc(size_t elements, size_t size) {
+    void *bp;
+    size_t asize = elements * size;
+
+    if (elements == 0 || asize == 0) {
+        return NULL;
+    }
+    if (asize / elements != size) {
+        // Multiplication overflowed
+        return NULL;
+    }
+
+    dbg_requires(check_heap(__LINE__));
+
+    if (heap_start == NULL) {
+        mm_init();
+    }
+
+    // A mapped region is zero already
+    if (asize >= map_threshold) {
+        block_t *block = map_block(asize);
+        if (block == NULL) {
+            return NULL;
+        }
+        dbg_ensures(check_heap(__LINE__));
+        return header_to_payload(block);
+    }
+
+    block_t *block = place_block(round_up(asize + wsize, dsize));
+    if (block == NULL) {
+        return NULL;
+    }
+    bp = header_to_payload(block);
+
+    // Only [zero_lo, zero_hi) is known to be zero; clear the rest
+    char *p = (char *)bp;
+    char *zero_lo = get_state()->zero_frontier;
+    char *zero_hi = (char *)mem_heap_hi() + 1 - dsize;
+    if (zero_lo < p) {
+        zero_lo = p;
+    }
+    if (zero_lo >= zero_hi || zero_lo >= p + asize) {
+        memset(p, 0, asize);
+    } else {
+        memset(p, 0, (size_t)(zero_lo - p));
+        if (p + asize > zero_hi) {
+            memset(zero_hi, 0, (size_t)(p + asize - zero_hi));
+        }
+    }
+    touch_block(block);
+
+    dbg_ensures(check_heap(__LINE__));
+    return bp;
+}
+
+/**
+ * allocate n blocks of the same size in one call
+ *
+ * The size is adjusted once. Blocks come from the fast bin of that size
+ * first. The rest are cut from free blocks, preferring one that fits the
+ * whole remainder of the batch, or from a single growth of the heap.
+ *
+ * param[in] size
+ * param[in] n
+ * param[out] ptrs filled in with the payloads of the allocated blocks
+ * return the number of blocks allocated, less than n only if memory ran
+ *        out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    dbg_requires(check_heap(__LINE__));
+
+    size_t done = 0;
+
+    if (heap_start == NULL) {
+        mm_init();
+    }
+
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+
+    // Huge blocks each get a region of their own anyway
+    if (size >= map_threshold) {
+        for (; done < n; done++) {
+            block_t *block = map_block(size);
+            if (block == NULL) {
+                break;
+            }
+            ptrs[done] = header_to_payload(block);
+        }
+        dbg_ensures(check_heap(__LINE__));
+        return done;
+    }
+
+    size_t asize = round_up(size + wsize, dsize);
+
+    if (asize <= fast_max) {
+        block_t *block;
+        while (done < n && (block = pop_fast(asize)) != NULL) {
+            touch_block(block);
+            ptrs[done++] = header_to_payload(block);
+        }
+    }
+
+    while (done < n) {
+        // Look for room for the rest of the batch, up to map_threshold
+        size_t want = asize * min(n - done, max(1, map_threshold / asize));
+        block_t *block = find_fit(want);
+        if (block == NULL) {
+            block = find_fit(asize);
+        }
+        if (block == NULL && get_state()->fast_bytes != 0) {
+            consolidate_fast();
+            block = find_fit(asize);
+        }
+        if (block == NULL) {
+            block = find_top(asize, 0);
+        }
+        if (block == NULL) {
+            block = extend_heap(grow_size(want));
+            if (block == NULL) {
+                break;
+            }
+        }
+        done += carve_blocks(block, asize, n - done, ptrs + done);
+    }
+
+    dbg_ensures(check_heap(__LINE__));
+    return done;
+}
+
+/**
+ * free n blocks in one call
+ *
+ * Consecutive entries that are next to each other in the heap, in either
+ * direction, are freed and coalesced as one block, as happens when blocks
+ * are freed in the order they were allocated or the reverse. Other blocks
+ * are freed as by free. Sorting the array would find more such runs, but
+ * costs more than it saves.
+ *
+ * param[in] n
+ * param[in] ptrs the payloads to free; NULL entries are skipped
+ */
+void mm_free_batch(size_t n, void **ptrs) {
+    dbg_requires(check_heap(__LINE__));
+
+    size_t i = 0;
+    while (i < n) {
+        if (ptrs[i] == NULL) {
+            i++;
+            continue;
+        }
+        block_t *block = payload_to_header(ptrs[i]);
+        if (is_mapped(block)) {
+            unmap_block(block);
+            i++;
+            continue;
+        }
+
+        // Extend the run while the next pointer is the block after it, or
+        // the block before it
+        char *end = (char *)block + get_size(block);
+        size_t j = i + 1;
+        for (; j < n && ptrs[j] != NULL; j++) {
+            block_t *next = payload_to_header(ptrs[j]);
+            if ((char *)next == end) {
+                end += get_size(next);
+            } else if ((char *)next + get_size(next) == (char *)block &&
+                       !is_mapped(next)) {
+                block = next;
+            } else {
+                break;
+            }
+        }
+
+        // One header covers the run, which is then freed as one block
+        size_t size = (size_t)(end - (char *)block);
+        if (j > i + 1) {
+            block->header = pack(size, get_prev_alloc(block), true,
+                                 is_minblock(block));
+            mark_dirty(block);
+            // the run may have ended in a mini block
+            modify_next(find_next(block), true, false);
+        }
+        if (size <= fast_max) {
+            push_fast(block);
+        } else {
+            release_block(block);
+        }
+        i = j;
+    }
+
+    dbg_ensures(check_heap(__LINE__));
+}
+
+/**
+ * allocate a block whose payload is aligned to a power of two
+ *
+ * Alignments of up to dsize are those of malloc. For larger ones the block
+ * is placed at an aligned address inside a free block, and the bytes in
+ * front of it go back to the free lists. Requests from map_threshold up
+ * stay in the heap too, since a mapped block's payload sits at a fixed
+ * offset into its region.
+ *
+ * param[in] alignment a power of two
+ * param[in] size
+ * return the aligned payload, or NULL if the alignment is invalid or
+ *        memory ran out
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= dsize) {
+        return malloc(size);
+    }
+
+    dbg_requires(check_heap(__LINE__));
+
+    if (heap_start == NULL) {
+        mm_init();
+    }
+
+    // The heap may have to grow by the size plus the alignment
+    if (size == 0 || size > (size_t)-1 - 2 * alignment) {
+        return NULL;
+    }
+
+    size_t asize = round_up(size + wsize, dsize);
+    block_t *block = find_fit_aligned(asize, alignment);
+    if (block == NULL && get_state()->fast_bytes != 0) {
+        consolidate_fast();
+        block = find_fit_aligned(asize, alignment);
+    }
+    if (block == NULL) {
+        block = find_top(asize, alignment);
+    }
+    if (block == NULL) {
+        // Any block this large has an aligned fit
+        block = extend_heap(grow_size(asize + alignment));
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    block = place_aligned(block, asize, alignment);
+    touch_block(block);
+
+    dbg_ensures(check_heap(__LINE__));
+    return header_to_payload(block);
+}
+
+/**
+ * report how many bytes of an allocated block its owner may use
+ *
+ * This is the whole payload, which can be more than was asked for. The
+ * bytes past the request can be used as if they had been asked for.
+ *
+ * param[in] ptr the payload of an allocated block, or NULL
+ * return the usable size, or 0 for NULL
+ */
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    return get_payload_size(payload_to_header(ptr));
+}
+
+/**
+ * report the usable size that malloc gives a request of size bytes
+ *
+ * Block sizes and the minimum block size are all multiples of dsize, so
+ * splitting always leaves a block of exactly the adjusted size, whichever
+ * free block it was cut from. A mapped block gets whole pages.
+ *
+ * param[in] size
+ * return what mm_usable_size reports for the block, or 0 for size 0
+ */
+size_t mm_good_size(size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    if (size >= map_threshold) {
+        size_t pagesize = mem_pagesize();
+        if (size > (size_t)-1 - dsize - pagesize) {
+            return size;
+        }
+        return round_up(size + dsize, pagesize) - dsize;
+    }
+    return round_up(size + wsize, dsize) - wsize;
+}
+
+#ifndef DRIVER
+/*
+ * ---------------------------------------------------------------------------
+ *                        THREAD SAFETY (mm.so only)
+ * ---------------------------------------------------------------------------
+ */
+
+#undef malloc
+#undef free
+#undef realloc
+#undef calloc
+#undef mm_malloc_batch
+#undef mm_free_batch
+#undef mm_memalign
+
+/*
+ * Per-CPU caches need restartable sequences: glibc 2.35 or later, which
+ * registers every thread with the kernel, and the x86-64 code below.
+ * Elsewhere the thread caches are used instead.
+ */
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+#endif
+
+/** number of blocks each bin of a thread or CPU cache may hold */
+enum { tcache_max = 64 };
+
+/**
+ * A thread's cache of small blocks, one LIFO bin per size like the fast
+ * bins. The blocks keep their allocated header, so to the heap they are
+ * still in use, and the owning thread can take and return them without
+ * the lock.
+ */
+typedef struct {
+    block_t *bins[fast_count];
+    size_t counts[fast_count];
+    /** whether the thread's exit will flush the cache */
+    bool registered;
+} tcache_t;
+
+/** the most arenas mm.so will use */
+enum { max_arenas = 64 };
+
+/** remote frees an arena may queue before the freeing thread drains them */
+static const size_t remote_max = 256;
+
+/**
+ * An arena: one memlib heap with its own allocator, whose heap_start is
+ * kept here while no thread has it locked.
+ */
+typedef struct {
+    /** serializes calls into the arena's allocator */
+    pthread_mutex_t lock;
+    block_t *heap_start;
+    /**
+     * blocks freed by threads outside the arena, pushed without the lock
+     * and linked through next; whoever next locks the arena frees them
+     */
+    block_t *remote;
+    /** at least the number of blocks on the remote list */
+    size_t remote_count;
+} arena_t;
+
+static arena_t arenas[max_arenas];
+
+/** how many arenas the threads are spread over */
+static size_t arena_count;
+
+/** ticket for the next thread that needs an arena */
+static size_t next_arena = 0;
+
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+/** its destructor flushes a thread's cache when the thread exits */
+static pthread_key_t tcache_key;
+
+static __thread tcache_t tcache __attribute__((tls_model("initial-exec")));
+
+/** the arena the thread's own allocations come from */
+static __thread arena_t *thread_arena
+    __attribute__((tls_model("initial-exec")));
+
+/**
+ * free every block on an arena's remote list, in one batch
+ *
+ * param[in] arena an arena the caller has locked
+ */
+static void drain_remote(arena_t *arena) {
+    block_t *block =
+        __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+
+    while (block != NULL) {
+        block_t *next = block->next;
+        heap_free(header_to_payload(block));
+        block = next;
+        count++;
+    }
+    __atomic_sub_fetch(&arena->remote_count, count, __ATOMIC_RELAXED);
+}
+
+/**
+ * point the allocator and memlib at the heap of an arena just locked, and
+ * catch up on its remote frees
+ *
+ * param[in] arena
+ */
+static void enter_arena(arena_t *arena) {
+    heap_start = arena->heap_start;
+    mem_use_heap((size_t)(arena - arenas));
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) != NULL) {
+        drain_remote(arena);
+    }
+}
+
+/**
+ * lock an arena for a call into its allocator
+ *
+ * param[in] arena
+ */
+static void lock_arena(arena_t *arena) {
+    pthread_mutex_lock(&arena->lock);
+    enter_arena(arena);
+}
+
+/**
+ * unlock an arena after a call into its allocator
+ *
+ * param[in] arena
+ */
+static void unlock_arena(arena_t *arena) {
+    arena->heap_start = heap_start;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * fork handler: hold every arena, so none is copied into the child locked
+ * by a thread the child won't have
+ */
+static void lock_arenas(void) {
+    for (size_t i = 0; i < arena_count; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+/**
+ * fork handler: release the arenas held by lock_arenas
+ */
+static void unlock_arenas(void) {
+    for (size_t i = 0; i < arena_count; i++) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+/**
+ * find the arena whose heap holds a block, from its address alone
+ *
+ * param[in] block
+ * return the arena, or NULL if the block is mapped
+ */
+static arena_t *block_arena(block_t *block) {
+    int id = mem_heap_id(block);
+    return id < 0 ? NULL : &arenas[id];
+}
+
+/**
+ * queue a block on its arena's remote list, without taking the lock
+ *
+ * The list is a stack that any thread may push onto, and that is only
+ * ever emptied as a whole, so the push needs a single compare and swap.
+ * Only when the list grows long does the thread try to drain it, and then
+ * only if the lock is free.
+ *
+ * param[in] arena the arena that owns the block
+ * param[in] block an allocated block
+ */
+static void remote_free(arena_t *arena, block_t *block) {
+    // counted first, so the count never falls below the list length
+    size_t count =
+        __atomic_add_fetch(&arena->remote_count, 1, __ATOMIC_RELAXED);
+
+    block_t *head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+    do {
+        block->next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote, &head, block, true,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    if (count >= remote_max && pthread_mutex_trylock(&arena->lock) == 0) {
+        enter_arena(arena);
+        unlock_arena(arena);
+    }
+}
+
+/**
+ * free a block of any arena: the thread's own arena is locked, another
+ * arena gets a remote free, and a mapped block needs no lock at all
+ *
+ * param[in] block an allocated block
+ */
+static void arena_free(block_t *block) {
+    arena_t *arena = block_arena(block);
+
+    if (arena == NULL) {
+        heap_free(header_to_payload(block));
+    } else if (arena != thread_arena) {
+        remote_free(arena, block);
+    } else {
+        lock_arena(arena);
+        heap_free(header_to_payload(block));
+        unlock_arena(arena);
+    }
+}
+
+/**
+ * return every block in the calling thread's cache to its arena
+ *
+ * param[in] arg the cache, as registered with tcache_key
  */
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
+static void flush_tcache(void *arg) {
+    tcache_t *cache = arg;
+
+    for (size_t i = 0; i < fast_count; i++) {
+        block_t *block = cache->bins[i];
+        while (block != NULL) {
+            block_t *next = block->next;
+            arena_free(block);
+            block = next;
+        }
+        cache->bins[i] = NULL;
+        cache->counts[i] = 0;
+    }
+    cache->registered = false;
+}
 
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
-    bool prev_min = false;
+static void init_cpu_caches(void);
 
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        mm_init();
+/**
+ * one-time setup: the arenas, about two per CPU, the CPU caches, the
+ * thread exit hook, and the fork handlers
+ */
+static void thread_init(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    arena_count = min(cpus > 0 ? 2 * (size_t)cpus : 1, max_arenas);
+    arena_count = min(arena_count, mem_heaps());
+    for (size_t i = 0; i < arena_count; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
     }
+    init_cpu_caches();
+    pthread_key_create(&tcache_key, flush_tcache);
+    pthread_atfork(lock_arenas, unlock_arenas, unlock_arenas);
+}
 
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+/**
+ * return the calling thread's arena, handing out arenas round robin to
+ * threads on their first allocation
+ */
+static arena_t *get_arena(void) {
+    if (thread_arena == NULL) {
+        pthread_once(&thread_once, thread_init);
+        size_t ticket = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[ticket % arena_count];
     }
+    return thread_arena;
+}
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
-    if (asize == min_block_size) {
-        prev_min = true;
+/**
+ * take a block of exactly asize bytes from the thread cache
+ *
+ * param[in] asize a block size of at most fast_max bytes
+ * return the block, still marked allocated, or NULL if the bin is empty
+ */
+static block_t *tcache_pop(size_t asize) {
+    size_t i = asize / dsize - 1;
+    block_t *block = tcache.bins[i];
+
+    if (block != NULL) {
+        tcache.bins[i] = block->next;
+        tcache.counts[i]--;
     }
+    return block;
+}
 
-    // Search the free list for a fit
-    block = find_fit(asize);
+/**
+ * keep a freed small block in the thread cache, if its bin has room
+ *
+ * The caller passes the block size, read from the header's size bits or
+ * known from the request. The size bits cannot change while the caller
+ * owns the block, even though other threads may update its status bits
+ * under its arena's lock.
+ *
+ * param[in] block an allocated block of at most fast_max bytes
+ * param[in] asize the size of the block
+ * return true if the cache took the block
+ */
+static bool tcache_push(block_t *block, size_t asize) {
+    size_t i = asize / dsize - 1;
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
-        }
+    if (tcache.counts[i] >= tcache_max) {
+        return false;
     }
+    if (!tcache.registered) {
+        // set first: pthread_setspecific may allocate
+        tcache.registered = true;
+        pthread_once(&thread_once, thread_init);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    block->next = tcache.bins[i];
+    tcache.bins[i] = block;
+    tcache.counts[i]++;
+    return true;
+}
 
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block, false));
+/**
+ * A CPU's bin of small blocks of one size: a stack, so that a push or pop
+ * commits with the single store to count.
+ */
+typedef struct {
+    size_t count;
+    block_t *slots[tcache_max];
+} cpu_bin_t;
 
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-    bool prev_alloc = get_prev_alloc(block);
-    free2alloc(block, block_size, prev_alloc, true);
-    modify_next(find_next(block), true, prev_min);
+/** a CPU's cache of small blocks, one bin per size like the fast bins */
+typedef struct {
+    cpu_bin_t bins[fast_count];
+} cpu_cache_t;
 
-    // Try to split the block if too large
-    split_block(block, asize);
+/** one cache per configured CPU; NULL while the thread caches are used */
+static cpu_cache_t *cpu_caches = NULL;
 
-    bp = header_to_payload(block);
+static size_t cpu_cache_count = 0;
 
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+#ifdef HAVE_RSEQ
+/**
+ * return the calling thread's rseq area, registered by glibc
+ */
+static struct rseq *thread_rseq(void) {
+    char *tp;
+    __asm__("movq %%fs:0, %0" : "=r"(tp));
+    return (struct rseq *)(tp + __rseq_offset);
 }
 
 /**
+ * pop a block from a bin of the CPU the thread runs on, as a restartable
+ * sequence: if the thread is preempted or migrated before the count is
+ * stored, the kernel sends it to the abort handler instead
  *
- * function: free the current block and coalesce
- * argument: the block intended to free
- * postcondition: the block is freed
+ * param[in] rs the thread's rseq area
+ * param[in] cpu the CPU that owns the bin
+ * param[in] bin
+ * return the block, NULL if the bin is empty, or 1 if the sequence was
+ *        aborted and has to be retried
+ */
+static block_t *rseq_pop(struct rseq *rs, uint32_t cpu, cpu_bin_t *bin) {
+    block_t *block;
+
+    __asm__ __volatile__(".pushsection __rseq_cs, \"aw\"\n\t"
+                         ".balign 32\n\t"
+                         "3:\n\t"
+                         ".long 0x0, 0x0\n\t"
+                         ".quad 1f, (2f - 1f), 4f\n\t"
+                         ".popsection\n\t"
+                         "leaq 3b(%%rip), %%rax\n\t"
+                         "movq %%rax, %[rseq_cs]\n\t"
+                         "1:\n\t"
+                         "xorl %%eax, %%eax\n\t"
+                         "cmpl %[cpu], %[cpu_id]\n\t"
+                         "jnz 4f\n\t"
+                         "movq %[count], %%rcx\n\t"
+                         "testq %%rcx, %%rcx\n\t"
+                         "jz 2f\n\t"
+                         "movq -8(%[slots], %%rcx, 8), %%rax\n\t"
+                         "decq %%rcx\n\t"
+                         "movq %%rcx, %[count]\n\t"
+                         "2:\n\t"
+                         ".pushsection __rseq_failure, \"ax\"\n\t"
+                         ".byte 0x0f, 0xb9, 0x3d\n\t"
+                         ".long 0x53053053\n\t"
+                         "4:\n\t"
+                         "movl $1, %%eax\n\t"
+                         "jmp 2b\n\t"
+                         ".popsection\n\t"
+                         : "=&a"(block), [rseq_cs] "=m"(rs->rseq_cs),
+                           [count] "+m"(bin->count)
+                         : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id),
+                           [slots] "r"(bin->slots)
+                         : "rcx", "memory", "cc");
+    return block;
+}
+
+/**
+ * push a block onto a bin of the CPU the thread runs on, as a restartable
+ * sequence like rseq_pop
+ *
+ * param[in] rs the thread's rseq area
+ * param[in] cpu the CPU that owns the bin
+ * param[in] bin
+ * param[in] block
+ * return 0 if the block was pushed, 1 if the bin is full, or 2 if the
+ *        sequence was aborted and has to be retried
+ */
+static int rseq_push(struct rseq *rs, uint32_t cpu, cpu_bin_t *bin,
+                     block_t *block) {
+    int res;
+
+    __asm__ __volatile__(".pushsection __rseq_cs, \"aw\"\n\t"
+                         ".balign 32\n\t"
+                         "3:\n\t"
+                         ".long 0x0, 0x0\n\t"
+                         ".quad 1f, (2f - 1f), 4f\n\t"
+                         ".popsection\n\t"
+                         "leaq 3b(%%rip), %%rax\n\t"
+                         "movq %%rax, %[rseq_cs]\n\t"
+                         "1:\n\t"
+                         "movl $1, %%eax\n\t"
+                         "cmpl %[cpu], %[cpu_id]\n\t"
+                         "jnz 4f\n\t"
+                         "movq %[count], %%rcx\n\t"
+                         "cmpq %[max], %%rcx\n\t"
+                         "jae 2f\n\t"
+                         "movq %[block], (%[slots], %%rcx, 8)\n\t"
+                         "incq %%rcx\n\t"
+                         "xorl %%eax, %%eax\n\t"
+                         "movq %%rcx, %[count]\n\t"
+                         "2:\n\t"
+                         ".pushsection __rseq_failure, \"ax\"\n\t"
+                         ".byte 0x0f, 0xb9, 0x3d\n\t"
+                         ".long 0x53053053\n\t"
+                         "4:\n\t"
+                         "movl $2, %%eax\n\t"
+                         "jmp 2b\n\t"
+                         ".popsection\n\t"
+                         : "=&a"(res), [rseq_cs] "=m"(rs->rseq_cs),
+                           [count] "+m"(bin->count)
+                         : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id),
+                           [slots] "r"(bin->slots), [block] "r"(block),
+                           [max] "r"((size_t)tcache_max)
+                         : "rcx", "memory", "cc");
+    return res;
+}
+#endif /* def HAVE_RSEQ */
+
+/**
+ * set up the per-CPU caches, if the kernel and glibc support rseq and the
+ * calling thread is registered; called once, from thread_init
+ */
+static void init_cpu_caches(void) {
+#ifdef HAVE_RSEQ
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (__rseq_size == 0 || cpus <= 0 ||
+        thread_rseq()->cpu_id >= (uint32_t)cpus) {
+        return;
+    }
+
+    void *caches = mem_map((size_t)cpus * sizeof(cpu_cache_t));
+    if (caches == (void *)-1) {
+        return;
+    }
+    cpu_cache_count = (size_t)cpus;
+    __atomic_store_n(&cpu_caches, caches, __ATOMIC_RELEASE);
+#endif /* def HAVE_RSEQ */
+}
+
+/**
+ * take a block of exactly asize bytes from the cache of the thread's CPU,
+ * or from the thread cache where there are no CPU caches
+ *
+ * param[in] asize a block size of at most fast_max bytes
+ * return the block, still marked allocated, or NULL if the bin is empty
+ */
+static block_t *cache_pop(size_t asize) {
+#ifdef HAVE_RSEQ
+    cpu_cache_t *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+    if (caches != NULL) {
+        struct rseq *rs = thread_rseq();
+        size_t i = asize / dsize - 1;
+        for (;;) {
+            uint32_t cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+            if (cpu >= cpu_cache_count) {
+                // this thread isn't registered
+                return NULL;
+            }
+            block_t *block = rseq_pop(rs, cpu, &caches[cpu].bins[i]);
+            if (block != (block_t *)1) {
+                return block;
+            }
+        }
+    }
+#endif /* def HAVE_RSEQ */
+    return tcache_pop(asize);
+}
+
+/**
+ * keep a freed small block in the cache of the thread's CPU, or in the
+ * thread cache where there are no CPU caches
+ *
+ * param[in] block an allocated block of at most fast_max bytes
+ * param[in] asize the size of the block
+ * return true if the cache took the block
+ */
+static bool cache_push(block_t *block, size_t asize) {
+#ifdef HAVE_RSEQ
+    cpu_cache_t *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+    if (caches != NULL) {
+        struct rseq *rs = thread_rseq();
+        size_t i = asize / dsize - 1;
+        for (;;) {
+            uint32_t cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+            if (cpu >= cpu_cache_count) {
+                return false;
+            }
+            int res = rseq_push(rs, cpu, &caches[cpu].bins[i], block);
+            if (res != 2) {
+                return res == 0;
+            }
+        }
+    }
+#endif /* def HAVE_RSEQ */
+    return tcache_push(block, asize);
+}
+
+/**
+ * thread-safe malloc: small requests are served from the CPU or thread
+ * cache
+ *
+ * param[in] size
+ * return the payload of the allocated block, or NULL
+ */
+void *malloc(size_t size) {
+    if (size != 0 && size <= fast_max - wsize) {
+        block_t *block = cache_pop(round_up(size + wsize, dsize));
+        if (block != NULL) {
+            return header_to_payload(block);
+        }
+    }
+
+    arena_t *arena = get_arena();
+    lock_arena(arena);
+    void *bp = heap_malloc(size);
+    unlock_arena(arena);
+    return bp;
+}
+
+/**
+ * thread-safe free: small blocks go to the CPU or thread cache while it
+ * has room
  *
  * param[in] bp
- * return NONE
  */
 void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
-
     if (bp == NULL) {
         return;
     }
 
-    bool prev_min = false;
     block_t *block = payload_to_header(bp);
     size_t size = get_size(block);
-
-    if (size == min_block_size) {
-        prev_min = true;
+    if (size <= fast_max && cache_push(block, size)) {
+        return;
     }
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block, false));
+    arena_free(block);
+}
 
-    // Mark the block as free
-    bool prev_alloc = get_prev_alloc(block);
-    alloc2free(block, size, prev_alloc, false);
-    modify_next(find_next(block), false, prev_min);
+/**
+ * free a block whose requested size the caller still knows, as sized
+ * operator delete does
+ *
+ * A request small enough for the caches got a block of exactly its
+ * adjusted size, so the block goes to its cache bin without a read of its
+ * header. Blocks resized by realloc may have grown past that size and must
+ * go through free instead.
+ *
+ * param[in] bp
+ * param[in] size the size passed to malloc or mm_memalign
+ */
+void mm_free_sized(void *bp, size_t size) {
+    if (bp == NULL) {
+        return;
+    }
 
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
+    block_t *block = payload_to_header(bp);
+    if (size != 0 && size <= fast_max - wsize) {
+        size_t asize = round_up(size + wsize, dsize);
+        dbg_assert(get_size(block) == asize);
+        if (cache_push(block, asize)) {
+            return;
+        }
+    }
 
-    dbg_ensures(mm_checkheap(__LINE__));
+    arena_free(block);
 }
 
 /**
- *
- * function: reallocate a block to targeted size
- * arguments: the payload to be reallocated, the desired size
- * postcondition: if size == 0, fun equals free ptr
- *                if ptr == NULL, fun equals malloc(size)
- *                other: malloc new block and free old one
+ * thread-safe realloc
  *
  * param[in] ptr
  * param[in] size
- * return new reallocated block (void*)
+ * return the payload of the resized block, or NULL
  */
 void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
-
-    // If size == 0, then free block and return NULL
-    if (size == 0) {
-        free(ptr);
-        return NULL;
+    // A block is resized in the arena it came from
+    arena_t *arena = NULL;
+    if (ptr != NULL) {
+        arena = block_arena(payload_to_header(ptr));
     }
-
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL) {
-        return malloc(size);
+    if (arena == NULL) {
+        arena = get_arena();
     }
+    lock_arena(arena);
+    void *bp = heap_realloc(ptr, size);
+    unlock_arena(arena);
+    return bp;
+}
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
+/**
+ * thread-safe calloc: small requests are served from the CPU or thread
+ * cache
+ *
+ * param[in] elements
+ * param[in] size
+ * return the zeroed payload of the allocated block, or NULL
+ */
+void *calloc(size_t elements, size_t size) {
+    size_t asize = elements * size;
 
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL) {
-        return NULL;
+    if (elements != 0 && asize / elements == size && asize != 0 &&
+        asize <= fast_max - wsize) {
+        block_t *block = cache_pop(round_up(asize + wsize, dsize));
+        if (block != NULL) {
+            memset(header_to_payload(block), 0, asize);
+            return header_to_payload(block);
+        }
     }
 
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if (size < copysize) {
-        copysize = size;
+    arena_t *arena = get_arena();
+    lock_arena(arena);
+    void *bp = heap_calloc(elements, size);
+    unlock_arena(arena);
+    return bp;
+}
+
+/**
+ * thread-safe mm_malloc_batch: the whole batch comes from the thread's
+ * arena under one lock
+ *
+ * param[in] size
+ * param[in] n
+ * param[out] ptrs
+ * return the number of blocks allocated
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    arena_t *arena = get_arena();
+    lock_arena(arena);
+    size_t done = heap_malloc_batch(size, n, ptrs);
+    unlock_arena(arena);
+    return done;
+}
+
+/**
+ * thread-safe mm_free_batch: the blocks of the thread's arena are freed
+ * together under one lock, and the rest as by free
+ *
+ * param[in] n
+ * param[in,out] ptrs
+ */
+void mm_free_batch(size_t n, void **ptrs) {
+    arena_t *arena = get_arena();
+    size_t own = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+        if (block_arena(payload_to_header(ptrs[i])) == arena) {
+            void *p = ptrs[own];
+            ptrs[own++] = ptrs[i];
+            ptrs[i] = p;
+        } else {
+            free(ptrs[i]);
+        }
     }
-    memcpy(newptr, ptr, copysize);
 
-    // Free the old block
-    free(ptr);
+    lock_arena(arena);
+    heap_free_batch(own, ptrs);
+    unlock_arena(arena);
+}
 
-    return newptr;
+/**
+ * thread-safe mm_memalign
+ *
+ * param[in] alignment
+ * param[in] size
+ * return the aligned payload, or NULL
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    arena_t *arena = get_arena();
+    lock_arena(arena);
+    void *bp = heap_memalign(alignment, size);
+    unlock_arena(arena);
+    return bp;
 }
 
 /**
+ * allocate a block aligned to a power of two
  *
- * function: allocate block with all elements initialized to 0
- * arguments: size of one element, size of total elements
- * postcondition: allocated block is initialized
+ * param[in] alignment
+ * param[in] size
+ * return the aligned payload, or NULL
+ */
+void *memalign(size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
+}
+
+/**
+ * C11 aligned allocation
  *
- * param[in] elements
+ * param[in] alignment
  * param[in] size
- * return the allocated & intialized block or NULL
+ * return the aligned payload, or NULL
  */
-void *calloc(size_t elements, size_t size) {
-    void *bp;
-    size_t asize = elements * size;
+void *aligned_alloc(size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
+}
 
-    if (elements == 0) {
-        return NULL;
+/**
+ * POSIX aligned allocation
+ *
+ * param[out] memptr set to the aligned payload on success
+ * param[in] alignment a power of two multiple of sizeof(void *)
+ * param[in] size
+ * return 0, EINVAL for a bad alignment, or ENOMEM
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
     }
-    if (asize / elements != size) {
-        // Multiplication overflowed
-        return NULL;
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
     }
-
-    bp = malloc(asize);
+    void *bp = mm_memalign(alignment, size);
     if (bp == NULL) {
-        return NULL;
+        return ENOMEM;
     }
+    *memptr = bp;
+    return 0;
+}
+
+/**
+ * glibc's name for mm_usable_size
+ *
+ * param[in] ptr
+ * return the usable size of the block, or 0 for NULL
+ */
+size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+/**
+ * allocate a page-aligned block
+ *
+ * The C library has its own, which would otherwise hand out blocks from
+ * its heap for free to pass to this one.
+ *
+ * param[in] size
+ * return the aligned payload, or NULL
+ */
+void *valloc(size_t size) {
+    return mm_memalign(mem_pagesize(), size);
+}
 
-    return bp;
+/**
+ * allocate a page-aligned block of a whole number of pages
+ *
+ * param[in] size
+ * return the aligned payload, or NULL
+ */
+void *pvalloc(size_t size) {
+    size_t pagesize = mem_pagesize();
+    return mm_memalign(pagesize, round_up(max(size, 1), pagesize));
 }
+#endif /* ndef DRIVER */
 
 /*
  *****************************************************************************
@@ -56,8 +56,123 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate at least `size` bytes aligned to `alignment`.
+ *
+ * @param[in] alignment  A power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate at least `size` bytes aligned to `alignment` (C11).
+ *
+ * @param[in] alignment  A power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate at least `size` bytes aligned to `alignment` (POSIX).
+ *
+ * @param[out] memptr  Set to the beginning of the allocated bytes.
+ * @param[in] alignment  A power of two multiple of `sizeof(void *)`.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, EINVAL for a bad alignment, ENOMEM otherwise.
+ */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * @brief  Report the number of usable bytes in an allocated block.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  The usable size, at least the size requested; 0 for NULL.
+ */
+extern size_t malloc_usable_size(void *ptr);
+
+/**
+ * @brief  Marks an allocated block as free, given its requested size.
+ *
+ * Small blocks are freed without reading their headers.
+ *
+ * @param[in] ptr A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size passed to malloc or memalign; not for blocks
+ *                  resized by realloc.
+ */
+extern void mm_free_sized(void *ptr, size_t size);
 #endif
 
+/**
+ * @brief  Allocate at least `size` bytes aligned to `alignment`.
+ *
+ * The block is placed at an aligned address inside a free block, and the
+ * bytes in front of it stay free, so no more than `size` bytes are used.
+ *
+ * @param[in] alignment  A power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL if
+ *          the alignment is not a power of two or memory ran out.
+ */
+extern void *mm_memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Report the number of usable bytes in an allocated block.
+ *
+ * All of them may be written, not just the number requested.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  The usable size, at least the size requested; 0 for NULL.
+ */
+extern size_t mm_usable_size(void *ptr);
+
+/**
+ * @brief  Report the usable size that a request of `size` bytes gets.
+ *
+ * Growing a buffer to this size first uses slack that the allocator
+ * hands out anyway.
+ *
+ * @param[in] size  The number of bytes requested.
+ *
+ * @return  What mm_usable_size reports for such a block; 0 for 0.
+ */
+extern size_t mm_good_size(size_t size);
+
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each in one call.
+ *
+ * Cheaper than `n` calls to malloc: the size is looked up once and the
+ * blocks are cut from as few free blocks as possible.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks to allocate.
+ * @param[out] ptrs  Filled in with pointers to the allocated blocks.
+ *
+ * @return  The number of blocks allocated, less than `n` only if memory
+ *          ran out.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+
+/**
+ * @brief  Mark `n` allocated blocks as free in one call.
+ *
+ * Consecutive entries that lie next to each other in the heap are coalesced
+ * together once, rather than one at a time.
+ *
+ * @param[in] n  The number of pointers in `ptrs`.
+ * @param[in,out] ptrs  Pointers to the beginnings of the payloads; NULL
+ *                      entries are ignored.  The array may be reordered.
+ */
+extern void mm_free_batch(size_t n, void **ptrs);
+
 /**
  * @brief  Initialize the heap.
  *
@@ -74,3 +189,81 @@ extern bool mm_init(void);
  * @return  True if the heap is consistent, False otherwise.
  */
 extern bool mm_checkheap(int line);
+
+/**
+ * @brief  Check the heap as mm_checkheap does, on several threads.
+ *
+ * The heap is split at block boundaries into segments that the threads
+ * walk at the same time, so a large heap is checked faster.
+ *
+ * @param[in] line  The line number this function is being called at.
+ * @param[in] threads  The number of threads to use; 1 checks the heap on
+ *                     the calling thread alone.
+ *
+ * @return  True if the heap is consistent, False otherwise.
+ */
+extern bool mm_checkheap_parallel(int line, int threads);
+
+/** Statistics on how the heap has grown, filled in by mm_growth */
+typedef struct {
+    bool adaptive; /* Whether the growth step adapts to demand */
+    size_t step;   /* Bytes the heap will grow by when nothing fits */
+    size_t count;  /* Number of times the heap has grown */
+    size_t bytes;  /* Total bytes the heap has grown by */
+    size_t trims;  /* Number of times the heap has been shrunk */
+} mm_growth_t;
+
+/**
+ * @brief  Report the heap growth policy and its statistics.
+ *
+ * @param[out] stats  Filled in with the statistics since mm_init.
+ */
+extern void mm_growth(mm_growth_t *stats);
+
+/** Counts of what the allocator's hot paths did, filled in by mm_stats */
+typedef struct {
+    bool enabled;        /* Whether the allocator was built to count */
+    size_t fits;         /* Number of fit searches */
+    size_t lists;        /* Free lists probed by the fit searches */
+    size_t nodes;        /* Free blocks looked at in the lists */
+    size_t capped;       /* List scans cut short by the search limit */
+    size_t splits;       /* Blocks split to fit a request */
+    size_t coalesce[4];  /* Coalesces with both neighbours free, only the
+                            previous, only the next, and neither */
+    size_t extends;      /* Number of times the heap was extended */
+    size_t extend_bytes; /* Total bytes the heap was extended by */
+} mm_stats_t;
+
+/**
+ * @brief  Report the hot-path counters.
+ *
+ * @param[out] stats  Filled in with the counts since mm_init; all zero
+ *                    unless `enabled` is set.
+ */
+extern void mm_stats(mm_stats_t *stats);
+
+/** Number of size classes reported by mm_heapinfo */
+enum { mm_class_count = 14 };
+
+/** A snapshot of the free space in the heap, filled in by mm_heapinfo */
+typedef struct {
+    /* Smallest block size of each class; the last class is unbounded */
+    size_t class_min[mm_class_count];
+    size_t class_bytes[mm_class_count]; /* Free bytes in each class */
+    size_t free_bytes;   /* Total bytes in free blocks */
+    size_t free_blocks;  /* Number of free blocks */
+    size_t largest;      /* Size of the largest free block */
+    size_t top;          /* Size of the free block that ends the heap, in
+                            free_bytes but in no class, or 0 */
+    size_t cached_bytes; /* Freed bytes held back for reuse, not in the
+                            free blocks (fast bins) */
+    double frag;         /* External fragmentation: 1 - largest / (free and
+                            cached bytes), or 0 if there are none */
+} mm_heapinfo_t;
+
+/**
+ * @brief  Report the free space in the heap without walking it.
+ *
+ * @param[out] info  Filled in with the free space as it is now.
+ */
+extern void mm_heapinfo(mm_heapinfo_t *info);
@@ -0,0 +1,316 @@
+/*
+ * mtbench.c - Multi-threaded malloc benchmark
+ *
+ * Each thread keeps a private array of slots and repeatedly frees a random
+ * slot and allocates it again.  Most requests are small, so the work is
+ * dominated by same-size malloc/free pairs, with an occasional larger block
+ * and realloc.  Every thread does the same number of operations, and the
+ * run is repeated with 1, 2, 4, ... threads up to the maximum.  For each
+ * run the throughput and the speedup over one thread are printed.
+ *
+ * With -p, each thread is instead a producer paired with a consumer thread:
+ * the producer allocates blocks and hands them over through a ring, and the
+ * consumer frees them, so every free is of a block from another thread.
+ *
+ * The benchmark calls the C library functions, so it measures whichever
+ * allocator is loaded:
+ *
+ *     unix> ./mtbench                      # the system malloc
+ *     unix> LD_PRELOAD=./mm.so ./mtbench   # mm.c
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Blocks in flight from a producer to its consumer */
+typedef struct
+{
+    char **slot;
+    long size;  /* Capacity of the ring */
+    long head;  /* Blocks produced */
+    long tail;  /* Blocks consumed */
+} ring_t;
+
+/* Benchmark parameters */
+typedef struct
+{
+    long ops;   /* Operations per thread */
+    int slots;  /* Live blocks per thread */
+    int seed;   /* Seed of the thread's generator */
+    ring_t *ring;  /* Shared with the partner thread, for -p */
+    pthread_barrier_t *start;
+} bench_t;
+
+static void usage(char *prog);
+static void *bench_thread(void *arg);
+static void *producer_thread(void *arg);
+static void *consumer_thread(void *arg);
+static double run(int threads, long ops, int slots, int pairs);
+
+int main(int argc, char **argv)
+{
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long ops = 1000000;
+    int slots = 1000;
+    int pairs = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "hpt:n:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'p':
+            pairs = 1;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 's':
+            slots = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (max_threads < 1 || ops < 1 || slots < 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (pairs)
+        printf("%d blocks per producer, %d in flight per pair\n", (int)ops,
+               slots);
+    else
+        printf("%d ops per thread, %d live blocks per thread\n", (int)ops,
+               slots);
+    printf("%s    Mops/s   speedup\n", pairs ? "  pairs" : "threads");
+    double base = 0;
+    for (int threads = 1;; threads *= 2)
+    {
+        if (threads > max_threads)
+            threads = max_threads;
+        double tput = run(threads, ops, slots, pairs);
+        if (threads == 1)
+            base = tput;
+        printf("%7d %9.2f %9.2f\n", threads, tput, tput / base);
+        fflush(stdout);
+        if (threads == max_threads)
+            break;
+    }
+    return 0;
+}
+
+/*
+ * run - run the benchmark on some threads, or on some producer-consumer
+ *       pairs of threads, returning total Mops/s
+ */
+static double run(int threads, long ops, int slots, int pairs)
+{
+    int nthreads = pairs ? 2 * threads : threads;
+    pthread_t *tids = calloc((size_t)nthreads, sizeof(pthread_t));
+    bench_t *params = calloc((size_t)nthreads, sizeof(bench_t));
+    ring_t *rings = calloc((size_t)threads, sizeof(ring_t));
+    pthread_barrier_t start;
+    struct timespec t0, t1;
+
+    if (tids == NULL || params == NULL || rings == NULL)
+    {
+        fprintf(stderr, "mtbench: out of memory\n");
+        exit(1);
+    }
+    pthread_barrier_init(&start, NULL, (unsigned)nthreads + 1);
+    for (int i = 0; i < nthreads; i++)
+    {
+        void *(*fn)(void *) = bench_thread;
+        params[i].ops = ops;
+        params[i].slots = slots;
+        params[i].seed = i + 1;
+        params[i].start = &start;
+        if (pairs)
+        {
+            ring_t *ring = &rings[i / 2];
+            if (i % 2 == 0)
+            {
+                ring->size = slots;
+                ring->slot = calloc((size_t)slots, sizeof(char *));
+                if (ring->slot == NULL)
+                {
+                    fprintf(stderr, "mtbench: out of memory\n");
+                    exit(1);
+                }
+            }
+            params[i].ring = ring;
+            fn = (i % 2 == 0) ? producer_thread : consumer_thread;
+        }
+        if (pthread_create(&tids[i], NULL, fn, &params[i]) != 0)
+        {
+            fprintf(stderr, "mtbench: pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_barrier_destroy(&start);
+    for (int i = 0; pairs && i < threads; i++)
+        free(rings[i].slot);
+    free(rings);
+    free(params);
+    free(tids);
+
+    double secs = (double)(t1.tv_sec - t0.tv_sec) +
+                  (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return (double)threads * (double)ops / secs / 1e6;
+}
+
+/*
+ * bench_thread - free and reallocate random slots of a private array
+ */
+static void *bench_thread(void *arg)
+{
+    bench_t *params = arg;
+    char **slot = calloc((size_t)params->slots, sizeof(char *));
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (uint64_t)params->seed;
+
+    if (slot == NULL)
+    {
+        fprintf(stderr, "mtbench: out of memory\n");
+        exit(1);
+    }
+
+    pthread_barrier_wait(params->start);
+    for (long op = 0; op < params->ops; op++)
+    {
+        /* xorshift generator */
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        int i = (int)(x % (uint64_t)params->slots);
+        size_t size;
+        if ((x >> 32) % 64 == 0)
+            size = 128 + (x >> 40) % 4096;
+        else
+            size = 8 + (x >> 40) % 104;
+
+        if (slot[i] != NULL && (x >> 24) % 16 == 0)
+        {
+            char *p = realloc(slot[i], size);
+            if (p == NULL)
+            {
+                fprintf(stderr, "mtbench: realloc failed\n");
+                exit(1);
+            }
+            slot[i] = p;
+        }
+        else
+        {
+            free(slot[i]);
+            slot[i] = malloc(size);
+            if (slot[i] == NULL)
+            {
+                fprintf(stderr, "mtbench: malloc failed\n");
+                exit(1);
+            }
+        }
+        /* touch the block so the allocator can't be lazy */
+        slot[i][0] = (char)op;
+    }
+
+    for (int i = 0; i < params->slots; i++)
+        free(slot[i]);
+    free(slot);
+    return NULL;
+}
+
+/*
+ * producer_thread - allocate blocks and pass them to the consumer
+ */
+static void *producer_thread(void *arg)
+{
+    bench_t *params = arg;
+    ring_t *ring = params->ring;
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (uint64_t)params->seed;
+
+    pthread_barrier_wait(params->start);
+    for (long op = 0; op < params->ops; op++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        size_t size = 8 + (x >> 40) % 1024;
+        char *p = malloc(size);
+        if (p == NULL)
+        {
+            fprintf(stderr, "mtbench: malloc failed\n");
+            exit(1);
+        }
+        p[0] = (char)op;
+
+        /* wait for room in the ring */
+        while (op - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+               ring->size)
+            sched_yield();
+        ring->slot[op % ring->size] = p;
+        __atomic_store_n(&ring->head, op + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * consumer_thread - free the blocks the producer passes over
+ */
+static void *consumer_thread(void *arg)
+{
+    bench_t *params = arg;
+    ring_t *ring = params->ring;
+
+    pthread_barrier_wait(params->start);
+    for (long op = 0; op < params->ops; op++)
+    {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) <= op)
+            sched_yield();
+        char *p = ring->slot[op % ring->size];
+        if (p[0] != (char)op)
+        {
+            fprintf(stderr, "mtbench: block %ld corrupted\n", op);
+            exit(1);
+        }
+        free(p);
+        __atomic_store_n(&ring->tail, op + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-hp] [-t <n>] [-n <n>] [-s <n>]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-p         Run producer-consumer pairs of threads.\n");
+    fprintf(stderr, "\t-t <n>     Run with up to n threads "
+                    "(default: online CPUs).\n");
+    fprintf(stderr, "\t-n <n>     Operations per thread "
+                    "(default: 1000000).\n");
+    fprintf(stderr, "\t-s <n>     Live blocks per thread (default: 1000).\n");
+}